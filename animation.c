@@ -1,5 +1,7 @@
 
+#include <pthread.h>
 #include "animation.h"
+#include "memory.h"
 
 #define MAX_LAYERS 2048
 
@@ -13,15 +15,34 @@ static struct frame_t _frames[MAX_FRAMES];
 static struct frame_t *_next_free_frame;
 static int _total_frames_count;
 
-#define MAX_ANIMATIONS 64
+#define MAX_ANIMATIONS 128
 
 static struct anim_t _animations[MAX_ANIMATIONS];
 static struct anim_t *_next_free_animation;
 static int _total_animations_count;
 
+#define MAX_INSTANCES 64
+
+static struct anim_instance_t _instances[MAX_INSTANCES];
+static struct anim_instance_t *_next_free_instance;
+
+#define DEFAULT_CACHE_SIZE (32 << 20)
+
+static int _cache_size = DEFAULT_CACHE_SIZE;
+static uint32_t _cache_counter;
+
+/* the pools and the cache are shared with the preload thread */
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct anim_stats_t *_stats;
+
+static int evict_animation();
 
 static struct layer_t *find_free_layer() {
 	struct layer_t *layer = _next_free_layer;
+	if (!layer && evict_animation()) {
+		layer = _next_free_layer;
+	}
 	if (layer) {
 		_next_free_layer = layer->next_free;
 		layer->next_free = 0;
@@ -41,6 +62,9 @@ static void free_layer(struct layer_t *layer) {
 
 static struct frame_t *find_free_frame() {
 	struct frame_t *frame = _next_free_frame;
+	if (!frame && evict_animation()) {
+		frame = _next_free_frame;
+	}
 	if (frame) {
 		_next_free_frame = frame->next_free;
 		frame->next_free = 0;
@@ -60,6 +84,9 @@ static void FreeFrame(struct frame_t *frame) {
 
 static struct anim_t *find_free_animation() {
 	struct anim_t *animation = _next_free_animation;
+	if (!animation && evict_animation()) {
+		animation = _next_free_animation;
+	}
 	if (animation) {
 		_next_free_animation = animation->next_free;
 		animation->next_free = 0;
@@ -76,6 +103,204 @@ static void free_animation(struct anim_t *animation) {
 	--_total_animations_count;
 }
 
+static void free_animation_data(struct anim_t *animation) {
+	for (struct frame_t *frame = animation->first_frame; frame; ) {
+		struct frame_t *next_frame = frame->next_frame;
+		Worker_Wait(&frame->decoding);
+		for (struct layer_t *layer = frame->first_layer; layer; ) {
+			struct layer_t *next_layer = layer->next_layer;
+			if (!animation->mapped) {
+				free(layer->rgba);
+			}
+			memset(layer, 0, sizeof(struct layer_t));
+			free_layer(layer);
+			layer = next_layer;
+		}
+		memset(frame, 0, sizeof(struct frame_t));
+		FreeFrame(frame);
+		frame = next_frame;
+	}
+	Memory_Add(MEMORY_LAYERS, -animation->size);
+	free(animation->key);
+	memset(animation, 0, sizeof(struct anim_t));
+	free_animation(animation);
+}
+
+/* unused animations are kept decoded until the cache size is exceeded */
+
+static struct anim_t *find_cached_animation(const char *key) {
+	for (int i = 0; i < MAX_ANIMATIONS; ++i) {
+		if (_animations[i].key && strcmp(_animations[i].key, key) == 0) {
+			return &_animations[i];
+		}
+	}
+	return 0;
+}
+
+static int evict_animation() {
+	struct anim_t *lru = 0;
+	for (int i = 0; i < MAX_ANIMATIONS; ++i) {
+		struct anim_t *animation = &_animations[i];
+		if (animation->key && animation->refs == 0) {
+			if (!lru || (int32_t)(animation->last_used - lru->last_used) < 0) {
+				lru = animation;
+			}
+		}
+	}
+	if (lru) {
+		free_animation_data(lru);
+		return 1;
+	}
+	return 0;
+}
+
+static int get_cached_size() {
+	int size = 0;
+	for (int i = 0; i < MAX_ANIMATIONS; ++i) {
+		if (_animations[i].key && _animations[i].refs == 0) {
+			size += _animations[i].size;
+		}
+	}
+	return size;
+}
+
+/* the memory budgets are also enforced when set */
+static void trim_cache() {
+	int size;
+	while (((size = get_cached_size()) > _cache_size || Memory_IsOverBudget(MEMORY_LAYERS, size)) && evict_animation());
+}
+
+static void release_animation(struct anim_t *animation) {
+	assert(animation->refs > 0);
+	if (--animation->refs == 0) {
+		if (animation->key) {
+			animation->last_used = ++_cache_counter;
+			trim_cache();
+		} else {
+			free_animation_data(animation);
+		}
+	}
+}
+
+static struct anim_stats_t *find_stats(const char *key, bool create) {
+	for (struct anim_stats_t *stats = _stats; stats; stats = stats->next) {
+		if (strcmp(stats->key, key) == 0) {
+			return stats;
+		}
+	}
+	if (!create) {
+		return 0;
+	}
+	struct anim_stats_t *stats = (struct anim_stats_t *)calloc(1, sizeof(struct anim_stats_t));
+	if (stats) {
+		stats->key = strdup(key);
+		stats->next = _stats;
+		_stats = stats;
+	}
+	return stats;
+}
+
+static int get_total_time(const struct anim_stats_t *stats) {
+	return stats->lookup_time + stats->parse_time + stats->inflate_time + stats->convert_time;
+}
+
+static int compare_stats(const void *a, const void *b) {
+	return get_total_time(*(const struct anim_stats_t **)b) - get_total_time(*(const struct anim_stats_t **)a);
+}
+
+static void dump_stats() {
+	int count = 0;
+	for (struct anim_stats_t *stats = _stats; stats; stats = stats->next) {
+		++count;
+	}
+	struct anim_stats_t **sorted = (struct anim_stats_t **)malloc(count * sizeof(struct anim_stats_t *));
+	if (sorted) {
+		count = 0;
+		for (struct anim_stats_t *stats = _stats; stats; stats = stats->next) {
+			sorted[count++] = stats;
+		}
+		qsort(sorted, count, sizeof(struct anim_stats_t *), compare_stats);
+		fprintf(stdout, "%5s %5s %9s %8s %8s %8s %8s %9s %6s %6s  %s\n", "loads", "hits", "read", "lookup", "parse", "inflate", "convert", "resident", "frames", "layers", "asset");
+		for (int i = 0; i < count; ++i) {
+			const struct anim_stats_t *stats = sorted[i];
+			fprintf(stdout, "%5d %5d %9d %8.1f %8.1f %8.1f %8.1f %9d %6d %6d  %s\n",
+				stats->loads_count, stats->hits_count, stats->bytes_read,
+				stats->lookup_time / 1000., stats->parse_time / 1000., stats->inflate_time / 1000., stats->convert_time / 1000.,
+				stats->resident_size, stats->frames_count, stats->layers_count, stats->key);
+		}
+		free(sorted);
+	}
+	while (_stats) {
+		struct anim_stats_t *next = _stats->next;
+		free(_stats->key);
+		free(_stats);
+		_stats = next;
+	}
+}
+
+static void setup_animation(struct anim_t *animation, const char *key) {
+	int num = 0;
+	int size = 0;
+	for (struct frame_t *frame = animation->first_frame; frame; frame = frame->next_frame) {
+		for (struct layer_t *layer = frame->first_layer; layer; layer = layer->next_layer) {
+			layer->num = num++;
+			size += layer->w * layer->h * sizeof(uint32_t);
+		}
+	}
+	animation->layers_count = num;
+	animation->size = animation->mapped ? 0 : size;
+	Memory_Add(MEMORY_LAYERS, animation->size);
+	animation->key = key ? strdup(key) : 0;
+	if (animation->stats) {
+		animation->stats->resident_size = animation->size;
+		animation->stats->frames_count = animation->frames_count;
+		animation->stats->layers_count = animation->layers_count;
+	}
+}
+
+static int create_instance(struct anim_t *animation, int mode) {
+	struct anim_instance_t *instance = _next_free_instance;
+	if (!instance) {
+		fprintf(stderr, "create_instance MAX_INSTANCES\n");
+		return -1;
+	}
+	uint8_t *layers_state = (uint8_t *)malloc(animation->layers_count + 1);
+	if (!layers_state) {
+		fprintf(stderr, "Failed to allocate %d bytes\n", animation->layers_count + 1);
+		return -1;
+	}
+	_next_free_instance = instance->next_free;
+	instance->next_free = 0;
+	for (struct frame_t *frame = animation->first_frame; frame; frame = frame->next_frame) {
+		for (struct layer_t *layer = frame->first_layer; layer; layer = layer->next_layer) {
+			layers_state[layer->num] = layer->state;
+		}
+	}
+	++animation->refs;
+	instance->anim = animation;
+	instance->current_frame = animation->first_frame;
+	instance->mode = mode;
+	instance->layers_state = layers_state;
+	return instance - _instances;
+}
+
+/* layers are decoded by the worker threads, waited for without the lock as the instance holds a reference */
+static void wait_instance(int anim) {
+	for (struct frame_t *frame = _instances[anim].anim->first_frame; frame; frame = frame->next_frame) {
+		Worker_Wait(&frame->decoding);
+		if (_instances[anim].mode != ANIM_LOAD_BLOCKING) {
+			break;
+		}
+	}
+}
+
+static void free_instance(struct anim_instance_t *instance) {
+	free(instance->layers_state);
+	memset(instance, 0, sizeof(struct anim_instance_t));
+	instance->next_free = _next_free_instance;
+	_next_free_instance = instance;
+}
+
 int Animation_Init() {
 	_next_free_layer = &_layers[0];
 	for (int i = 0; i < MAX_LAYERS - 1; ++i) {
@@ -89,11 +314,22 @@ int Animation_Init() {
 	for (int i = 0; i < MAX_ANIMATIONS - 1; ++i) {
 		_animations[i].next_free = &_animations[i + 1];
 	}
+	_next_free_instance = &_instances[0];
+	for (int i = 0; i < MAX_INSTANCES - 1; ++i) {
+		_instances[i].next_free = &_instances[i + 1];
+	}
 	return 0;
 }
 
 int Animation_Fini() {
-	fprintf(stdout, "Total animations %d frames %d layers %d\n", _total_animations_count, _total_frames_count, _total_layers_count);
+	pthread_mutex_lock(&_lock);
+	while (evict_animation());
+	/* the decoding jobs referencing the stats are all done */
+	dump_stats();
+	pthread_mutex_unlock(&_lock);
+	if (_total_animations_count != 0 || _total_frames_count != 0 || _total_layers_count != 0) {
+		fprintf(stdout, "Leaked animations %d frames %d layers %d\n", _total_animations_count, _total_frames_count, _total_layers_count);
+	}
 	return 0;
 }
 
@@ -106,50 +342,245 @@ static struct {
 	{ 0, 0 }
 };
 
-int Animation_Load(FILE *fp, const char *name) {
+static int add_instance(struct anim_t *animation, const char *key, int mode) {
+	setup_animation(animation, key);
+	const int anim = create_instance(animation, mode);
+	if (anim < 0 && animation->refs == 0) {
+		free_animation_data(animation);
+	}
+	return anim;
+}
+
+int Animation_Open(const char *key, int mode) {
+	int anim = -1;
+	pthread_mutex_lock(&_lock);
+	struct anim_t *animation = find_cached_animation(key);
+	if (animation) {
+		anim = create_instance(animation, mode);
+		if (animation->stats) {
+			++animation->stats->hits_count;
+		}
+	}
+	pthread_mutex_unlock(&_lock);
+	if (!(anim < 0)) {
+		wait_instance(anim);
+	}
+	return anim;
+}
+
+/* the loaders only take the lock to allocate from the pools */
+
+static struct frame_t *lock_free_frame() {
+	pthread_mutex_lock(&_lock);
+	struct frame_t *frame = find_free_frame();
+	pthread_mutex_unlock(&_lock);
+	return frame;
+}
+
+static struct layer_t *lock_free_layer() {
+	pthread_mutex_lock(&_lock);
+	struct layer_t *layer = find_free_layer();
+	pthread_mutex_unlock(&_lock);
+	return layer;
+}
+
+/* the file is parsed into a private animation without holding the lock, the slot is reserved but not cached yet */
+static struct anim_t *load_animation(FILE *fp, const char *name, const char *key) {
+	pthread_mutex_lock(&_lock);
+	struct anim_t *animation = find_free_animation();
+	struct anim_stats_t *stats = (animation && key) ? find_stats(key, true) : 0;
+	pthread_mutex_unlock(&_lock);
+	if (!animation) {
+		return 0;
+	}
+	for (int i = 0; _animationFormats[i].ext; ++i) {
+		if (strcasecmp(_animationFormats[i].ext, name) == 0) {
+			struct anim_t parsed;
+			memset(&parsed, 0, sizeof(parsed));
+			parsed.stats = stats;
+			const uint32_t t0 = get_time_us();
+			const int ret = _animationFormats[i].load(fp, &parsed, lock_free_frame, lock_free_layer);
+			if (ret < 0) {
+				break;
+			}
+			const uint32_t duration = get_time_us() - t0;
+			pthread_mutex_lock(&_lock);
+			*animation = parsed;
+			if (stats) {
+				++stats->loads_count;
+				stats->parse_time += duration;
+				stats->bytes_read += ftell(fp);
+			}
+			pthread_mutex_unlock(&_lock);
+			return animation;
+		}
+	}
+	fprintf(stderr, "Unsupported animation '%s'\n", name);
+	pthread_mutex_lock(&_lock);
+	free_animation(animation);
+	pthread_mutex_unlock(&_lock);
+	return 0;
+}
+
+/* the animation loaded meanwhile by the other thread is kept in the cache, the copy is freed with its last instance */
+static const char *get_cache_key(const char *key) {
+	return (key && !find_cached_animation(key)) ? key : 0;
+}
+
+int Animation_Load(FILE *fp, const char *name, const char *key, int mode) {
+	int anim = -1;
+	struct anim_t *animation = load_animation(fp, name, key);
+	if (animation) {
+		pthread_mutex_lock(&_lock);
+		anim = add_instance(animation, get_cache_key(key), mode);
+		pthread_mutex_unlock(&_lock);
+	}
+	if (!(anim < 0)) {
+		wait_instance(anim);
+	}
+	return anim;
+}
+
+int Animation_LoadBaked(const uint8_t *data, const char *key) {
+	int anim = -1;
+	pthread_mutex_lock(&_lock);
 	struct anim_t *animation = find_free_animation();
 	if (animation) {
-		for (int i = 0; _animationFormats[i].ext; ++i) {
-			if (strcasecmp(_animationFormats[i].ext, name) == 0) {
-				if (_animationFormats[i].load(fp, animation, find_free_frame, find_free_layer) < 0) {
-					break;
-				}
-				return animation - _animations;
+		const uint32_t t0 = get_time_us();
+		if (Animation_Load_Baked(data, animation, find_free_frame, find_free_layer) < 0) {
+			free_animation(animation);
+		} else {
+			animation->stats = key ? find_stats(key, true) : 0;
+			if (animation->stats) {
+				++animation->stats->loads_count;
+				animation->stats->parse_time += get_time_us() - t0;
+			}
+			animation->mapped = true;
+			anim = add_instance(animation, get_cache_key(key), ANIM_LOAD_BLOCKING);
+		}
+	}
+	pthread_mutex_unlock(&_lock);
+	if (!(anim < 0)) {
+		wait_instance(anim);
+	}
+	return anim;
+}
+
+int Animation_Preload(FILE *fp, const char *name, const char *key) {
+	pthread_mutex_lock(&_lock);
+	const bool cached = find_cached_animation(key) != 0;
+	pthread_mutex_unlock(&_lock);
+	if (cached) {
+		return 0;
+	}
+	/* the layers are decoded in the background, the animation is added to the cache without instance */
+	struct anim_t *animation = load_animation(fp, name, key);
+	if (!animation) {
+		return -1;
+	}
+	pthread_mutex_lock(&_lock);
+	const bool loaded = find_cached_animation(key) != 0;
+	if (!loaded) {
+		setup_animation(animation, key);
+		animation->last_used = ++_cache_counter;
+		trim_cache();
+	}
+	pthread_mutex_unlock(&_lock);
+	if (loaded) {
+		/* loaded by the main thread meanwhile, the layers being decoded are waited for without the lock */
+		for (struct frame_t *frame = animation->first_frame; frame; frame = frame->next_frame) {
+			Worker_Wait(&frame->decoding);
+		}
+		pthread_mutex_lock(&_lock);
+		setup_animation(animation, 0);
+		free_animation_data(animation);
+		pthread_mutex_unlock(&_lock);
+	}
+	return 0;
+}
+
+/* an animation never loaded, failed to load or evicted is not ready */
+int Animation_IsReady(const char *key) {
+	int ret = 0;
+	pthread_mutex_lock(&_lock);
+	struct anim_t *animation = find_cached_animation(key);
+	if (animation) {
+		ret = 1;
+		for (struct frame_t *frame = animation->first_frame; frame; frame = frame->next_frame) {
+			if (!Worker_IsDone(&frame->decoding)) {
+				ret = 0;
+				break;
 			}
 		}
-		fprintf(stderr, "Unsupported animation '%s'\n", name);
-		free_animation(animation);
 	}
-	return -1;
+	pthread_mutex_unlock(&_lock);
+	return ret;
 }
 
 int Animation_Free(int anim) {
 	assert(!(anim < 0));
-	for (struct frame_t *frame = _animations[anim].first_frame; frame; ) {
-		struct frame_t *next_frame = frame->next_frame;
-		for (struct layer_t *layer = frame->first_layer; layer; ) {
-			struct layer_t *next_layer = layer->next_layer;
-			free(layer->rgba);
-			memset(layer, 0, sizeof(struct layer_t));
-			free_layer(layer);
-			layer = next_layer;
+	pthread_mutex_lock(&_lock);
+	struct anim_t *animation = _instances[anim].anim;
+	free_instance(&_instances[anim]);
+	release_animation(animation);
+	pthread_mutex_unlock(&_lock);
+	return 0;
+}
+
+void Animation_AddLookupTime(const char *key, int duration) {
+	pthread_mutex_lock(&_lock);
+	struct anim_stats_t *stats = find_stats(key, true);
+	if (stats) {
+		stats->lookup_time += duration;
+	}
+	pthread_mutex_unlock(&_lock);
+}
+
+const struct anim_stats_t *Animation_GetStats(const char *key) {
+	pthread_mutex_lock(&_lock);
+	const struct anim_stats_t *stats = find_stats(key, false);
+	pthread_mutex_unlock(&_lock);
+	return stats;
+}
+
+void Animation_SetCacheSize(int size) {
+	pthread_mutex_lock(&_lock);
+	_cache_size = size;
+	trim_cache();
+	pthread_mutex_unlock(&_lock);
+}
+
+void Animation_TrimCache() {
+	pthread_mutex_lock(&_lock);
+	trim_cache();
+	pthread_mutex_unlock(&_lock);
+}
+
+int Animation_GetCachedSize() {
+	pthread_mutex_lock(&_lock);
+	const int size = get_cached_size();
+	pthread_mutex_unlock(&_lock);
+	return size;
+}
+
+int Animation_IsLoaded(int anim) {
+	assert(!(anim < 0));
+	for (struct frame_t *frame = _instances[anim].anim->first_frame; frame; frame = frame->next_frame) {
+		if (!Worker_IsDone(&frame->decoding)) {
+			return 0;
 		}
-		memset(frame, 0, sizeof(struct frame_t));
-		FreeFrame(frame);
-		frame = next_frame;
 	}
-	free_animation(&_animations[anim]);
-	return 0;
+	return 1;
 }
 
 int Animation_GetFramesCount(int anim) {
 	assert(!(anim < 0));
-	return _animations[anim].frames_count;
+	return _instances[anim].anim->frames_count;
 }
 
 int Animation_GetFrameLayersCount(int anim, int frame_num) {
 	assert(!(anim < 0));
-	struct frame_t *frame = _animations[anim].first_frame;
+	struct frame_t *frame = _instances[anim].anim->first_frame;
 	for (; frame_num-- != 0 && frame; frame = frame->next_frame);
 	assert(frame);
 	return frame->layers_count;
@@ -157,7 +588,7 @@ int Animation_GetFrameLayersCount(int anim, int frame_num) {
 
 int Animation_GetFrameRect(int anim, int frame_num, int *x, int *y, int *w, int *h) {
 	assert(!(anim < 0));
-	struct frame_t *frame = _animations[anim].first_frame;
+	struct frame_t *frame = _instances[anim].anim->first_frame;
 	for (; frame_num-- != 0 && frame; frame = frame->next_frame);
 	assert(frame);
 	int x1 = 640 - 1;
@@ -194,9 +625,10 @@ int Animation_GetFrameRect(int anim, int frame_num, int *x, int *y, int *w, int
 
 struct layer_t *Animation_GetLayer(int anim, int frame_num, int layer_num) {
 	assert(!(anim < 0));
-	struct frame_t *frame = _animations[anim].first_frame;
+	struct frame_t *frame = _instances[anim].anim->first_frame;
 	for (; frame_num-- != 0 && frame; frame = frame->next_frame);
 	assert(frame);
+	Worker_Wait(&frame->decoding);
 	struct layer_t *layer = frame->first_layer;
 	for (; layer_num-- != 0 && layer; layer = layer->next_layer);
 	assert(layer);
@@ -205,10 +637,13 @@ struct layer_t *Animation_GetLayer(int anim, int frame_num, int layer_num) {
 
 int Animation_Seek(int anim, int frame_num) {
 	assert(!(anim < 0));
-	struct frame_t *frame = _animations[anim].first_frame;
+	struct frame_t *frame = _instances[anim].anim->first_frame;
 	for (; frame_num-- != 0 && frame; frame = frame->next_frame);
 	assert(frame);
-	_animations[anim].current_frame = frame;
+	if (_instances[anim].mode == ANIM_LOAD_PROGRESSIVE) {
+		Worker_Wait(&frame->decoding);
+	}
+	_instances[anim].current_frame = frame;
 	return 0;
 }
 
@@ -216,16 +651,16 @@ int Animation_SetLayer(int anim, int frame_num, const char *name, int state) {
 	assert(!(anim < 0));
 	struct frame_t *frame;
 	if (frame_num < 0) {
-		frame = _animations[anim].current_frame;
+		frame = _instances[anim].current_frame;
 	} else {
-		frame = _animations[anim].first_frame;
+		frame = _instances[anim].anim->first_frame;
 		for (; frame_num-- != 0 && frame; frame = frame->next_frame);
 	}
 	assert(frame);
 	struct layer_t *layer = frame->first_layer;
 	for (; layer; layer = layer->next_layer) {
 		if (strcasecmp(layer->name, name) == 0) {
-			layer->state = state;
+			_instances[anim].layers_state[layer->num] = state;
 			break;
 		}
 	}
@@ -289,15 +724,23 @@ static int is_phoneme(struct layer_t *layer, int mask) {
 
 int Animation_Draw(int anim, struct surface_t *s, int dx, int dy, int mask, int alpha, int *x, int *y, int *w, int *h) {
 	assert(!(anim < 0));
-	struct frame_t *frame = _animations[anim].current_frame;
+	struct anim_instance_t *instance = &_instances[anim];
+	struct frame_t *frame = instance->current_frame;
 	assert(frame);
 	int x1 = 640 - 1;
 	int y1 = 480 - 1;
 	int x2 = 0;
 	int y2 = 0;
 	struct layer_t *layer = frame->first_layer;
+	if (instance->mode != ANIM_LOAD_BLOCKING && !Worker_IsDone(&frame->decoding)) {
+		if (instance->mode == ANIM_LOAD_PROGRESSIVE_SKIP) {
+			layer = 0;
+		} else {
+			Worker_Wait(&frame->decoding);
+		}
+	}
 	for (; layer; layer = layer->next_layer) {
-		if (layer->state == 0 || is_phoneme(layer, mask)) {
+		if (instance->layers_state[layer->num] == 0 || is_phoneme(layer, mask)) {
 			continue;
 		}
 		const int lx = layer->x + dx;
@@ -2,11 +2,14 @@
 #ifndef ANIMATION_H__
 #define ANIMATION_H__
 
+#include <stdatomic.h>
 #include "intern.h"
+#include "worker.h"
 
 struct layer_t {
 	int x, y, w, h;
 	int mask, state;
+	int num; /* index in the animation */
 	char name[64];
 	uint32_t *rgba;
 	struct layer_t *next_layer;
@@ -16,28 +19,78 @@ struct layer_t {
 struct frame_t {
 	int layers_count;
 	struct layer_t *first_layer;
+	struct worker_group_t decoding;
 	struct frame_t *next_frame;
 	struct frame_t *next_free;
 };
 
+enum {
+	ANIM_LOAD_BLOCKING = 0,
+	ANIM_LOAD_PROGRESSIVE, /* frames not decoded yet are waited for */
+	ANIM_LOAD_PROGRESSIVE_SKIP /* frames not decoded yet are not drawn */
+};
+
+/* load telemetry, times are in microseconds */
+struct anim_stats_t {
+	char *key;
+	int loads_count;
+	int hits_count;
+	int bytes_read;
+	int lookup_time;
+	int parse_time;
+	atomic_int inflate_time;
+	atomic_int convert_time;
+	int resident_size;
+	int frames_count;
+	int layers_count;
+	struct anim_stats_t *next;
+};
+
+/* decoded data, shared by the instances of a same asset */
 struct anim_t {
 	int frames_count;
 	struct frame_t *first_frame;
-	struct frame_t *current_frame;
+	int layers_count;
+	int size;
+	bool mapped;
+	int refs;
+	char *key; /* cached after the last instance is freed */
+	uint32_t last_used;
+	struct anim_stats_t *stats;
 	struct anim_t *next_free;
 };
 
+/* playback state */
+struct anim_instance_t {
+	struct anim_t *anim;
+	struct frame_t *current_frame;
+	int mode;
+	uint8_t *layers_state;
+	struct anim_instance_t *next_free;
+};
+
 typedef struct layer_t *(*FreeLayerProc)();
 typedef struct frame_t *(*FreeFrameProc)();
 
 int Animation_Load_MNG(FILE *, struct anim_t *, FreeFrameProc, FreeLayerProc);
 int Animation_Load_RLE(FILE *, struct anim_t *, FreeFrameProc, FreeLayerProc);
+int Animation_Load_Baked(const uint8_t *, struct anim_t *, FreeFrameProc, FreeLayerProc);
 
 int Animation_Init();
 int Animation_Fini();
 
-int Animation_Load(FILE *fp, const char *name);
+int Animation_Open(const char *key, int mode);
+int Animation_Load(FILE *fp, const char *name, const char *key, int mode);
+int Animation_LoadBaked(const uint8_t *data, const char *key);
+int Animation_Preload(FILE *fp, const char *name, const char *key);
+int Animation_IsReady(const char *key);
 int Animation_Free(int anim);
+int Animation_IsLoaded(int anim);
+void Animation_SetCacheSize(int size);
+void Animation_TrimCache();
+int Animation_GetCachedSize();
+void Animation_AddLookupTime(const char *key, int duration);
+const struct anim_stats_t *Animation_GetStats(const char *key);
 
 int Animation_GetFramesCount(int anim);
 int Animation_GetFrameLayersCount(int anim, int frame);
@@ -0,0 +1,44 @@
+
+#include "animation.h"
+#include "bakefile.h"
+
+int Animation_Load_Baked(const uint8_t *data, struct anim_t *anim, FreeFrameProc frameProc, FreeLayerProc layerProc) {
+	const struct bake_anim_t *hdr = (const struct bake_anim_t *)data;
+	const struct bake_frame_t *frames = (const struct bake_frame_t *)(hdr + 1);
+	const struct bake_layer_t *layers = (const struct bake_layer_t *)(frames + hdr->frames_count);
+
+	struct frame_t *previous_frame = 0;
+	for (int i = 0; i < hdr->frames_count; ++i) {
+		struct frame_t *frame = frameProc();
+		if (i == 0) {
+			anim->first_frame = frame;
+		} else {
+			previous_frame->next_frame = frame;
+		}
+		previous_frame = frame;
+
+		frame->layers_count = frames[i].layers_count;
+		struct layer_t *previous_layer = 0;
+		for (int j = 0; j < frame->layers_count; ++j, ++layers) {
+			struct layer_t *layer = layerProc();
+			if (j == 0) {
+				frame->first_layer = layer;
+			} else {
+				previous_layer->next_layer = layer;
+			}
+			previous_layer = layer;
+
+			layer->x = layers->x;
+			layer->y = layers->y;
+			layer->w = layers->w;
+			layer->h = layers->h;
+			layer->mask = layers->mask;
+			memcpy(layer->name, layers->name, sizeof(layer->name));
+			/* pixels are used in place from the mapping */
+			layer->rgba = layers->rgba_offset ? (uint32_t *)(data + layers->rgba_offset) : 0;
+			layer->state = 1;
+		}
+	}
+	anim->frames_count = hdr->frames_count;
+	return 0;
+}
@@ -68,7 +68,7 @@ static uint32_t *decode_bitmap(struct image_t *image, int has_pal, const uint8_t
 	return rgba;
 }
 
-static uint32_t *decode_zdata(struct image_t *image, int has_pal) {
+static uint32_t *decode_zdata(struct image_t *image, int has_pal, struct anim_stats_t *stats) {
 	int bpp = 0;
 	switch (image->color) {
 	case 2: /* RGB */
@@ -87,7 +87,11 @@ static uint32_t *decode_zdata(struct image_t *image, int has_pal) {
 	uint32_t *rgba = 0;
 	const int buf_size = image->h * (image->w * bpp) + (image->h);
 	if (image->zsize >= buf_size) { /* uncompressed */
+		const uint32_t t0 = get_time_us();
 		rgba = decode_bitmap(image, has_pal, image->zdata, buf_size, bpp);
+		if (stats) {
+			atomic_fetch_add(&stats->convert_time, get_time_us() - t0);
+		}
         } else {
 		uint8_t *buf = (uint8_t *)malloc(buf_size + 32);
 		if (!buf) {
@@ -100,6 +104,7 @@ static uint32_t *decode_zdata(struct image_t *image, int has_pal) {
 		z_str.next_in = image->zdata;
 		z_str.avail_out = buf_size;
 		z_str.next_out = buf;
+		uint32_t t0 = get_time_us();
 		int ret = inflateInit(&z_str);
 		if (ret == Z_OK) {
 			ret = inflate(&z_str, Z_FINISH);
@@ -107,6 +112,11 @@ static uint32_t *decode_zdata(struct image_t *image, int has_pal) {
 				fprintf(stderr, "inflate ret:%d bpp:%d w:%d h:%d color:%d zsize:%d\n", ret, bpp, image->w, image->h, image->color, image->zsize);
 			}
 		}
+		inflateEnd(&z_str);
+		if (stats) {
+			atomic_fetch_add(&stats->inflate_time, get_time_us() - t0);
+		}
+		t0 = get_time_us();
 		if (z_str.total_out != buf_size) {
 			if (image->w == 2 && image->h == 2 && z_str.total_out == 18 && image->color == 3) {
 				rgba = decode_bitmap(image, 0, buf, z_str.total_out, 4);
@@ -116,11 +126,47 @@ static uint32_t *decode_zdata(struct image_t *image, int has_pal) {
                 } else {
 			rgba = decode_bitmap(image, has_pal, buf, z_str.total_out, bpp);
 		}
+		if (stats) {
+			atomic_fetch_add(&stats->convert_time, get_time_us() - t0);
+		}
 		free(buf);
 	}
 	return rgba;
 }
 
+struct decode_job_t {
+	struct worker_job_t job;
+	struct layer_t *layer;
+	struct image_t image;
+	int has_pal;
+	struct anim_stats_t *stats;
+};
+
+static void decode_layer(void *param) {
+	struct decode_job_t *job = (struct decode_job_t *)param;
+	job->layer->rgba = decode_zdata(&job->image, job->has_pal, job->stats);
+	// fprintf(stdout, "decoded bitmap %d %d RGBA %p\n", job->image.w, job->image.h, job->layer->rgba);
+	free(job->image.zdata);
+	free(job);
+}
+
+static void queue_layer(struct frame_t *frame, struct layer_t *layer, struct image_t *image, int has_pal, struct anim_stats_t *stats) {
+	struct decode_job_t *job = (struct decode_job_t *)malloc(sizeof(struct decode_job_t));
+	if (!job) {
+		fprintf(stderr, "Failed to allocate %d bytes\n", (int)sizeof(struct decode_job_t));
+		free(image->zdata);
+		return;
+	}
+	job->layer = layer;
+	job->image = *image;
+	job->has_pal = has_pal;
+	job->stats = stats;
+	job->job.proc = decode_layer;
+	job->job.param = job;
+	job->job.group = &frame->decoding;
+	Worker_Queue(&job->job);
+}
+
 static void read_plte(FILE *fp, uint32_t *dst) {
 	for (int i = 0; i < 256; ++i) {
 		const uint8_t r = fgetc(fp);
@@ -261,11 +307,10 @@ int Animation_Load_MNG(FILE *fp, struct anim_t *anim, FreeFrameProc frameProc, F
 			break;
 		case TAG_IEND:
 			assert(size == 0);
-			current_layer->rgba = decode_zdata(&current_image, plte_flag);
 			current_layer->w = current_image.w;
 			current_layer->h = current_image.h;
-			// fprintf(stdout, "decoded bitmap %d %d RGBA %p\n", current_image.w, current_image.h, current_layer->rgba);
-			free(current_image.zdata);
+			/* the job takes ownership of zdata */
+			queue_layer(current_frame, current_layer, &current_image, plte_flag, anim->stats);
 			current_image.zdata = 0;
 			current_image.zsize = 0;
 			break;
@@ -279,6 +324,5 @@ int Animation_Load_MNG(FILE *fp, struct anim_t *anim, FreeFrameProc frameProc, F
 		}
 	}
 	anim->frames_count = frames_count;
-	anim->current_frame = anim->first_frame;
 	return 0;
 }
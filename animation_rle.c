@@ -7,63 +7,59 @@ static float le32_to_float(uint32_t x) {
 
 static const uint8_t RLE_SIG[] = { 0xF2, 0x65, 0x6C, 0x72, 0x00, 0x00, 0x20, 0x4D };
 
-static uint32_t *decode(FILE *fp, int size, int w, int h, int fmt, const uint32_t *palette) {
+static uint32_t read_color(const uint8_t *src, int color_size, const uint32_t *palette) {
+	return (color_size == 4) ? READ_LE_UINT32(src) : palette[*src];
+}
+
+/* the runs are checked against the remaining bytes and the layer size, a truncated layer is left partly transparent */
+static uint32_t *decode(const uint8_t *src, int size, int w, int h, int fmt, const uint32_t *palette) {
 	uint32_t *rgba = (uint32_t *)calloc(w * h, sizeof(uint32_t));
 	if (!rgba) {
 		fprintf(stderr, "Failed to allocate RGBA buffer w:%d h:%d\n", w, h);
 	} else {
-		int offset = 0;
+		int color_size = 0;
 		switch (fmt) {
 		case 0x40012F9:
 		case 0x40012FB: /* paletted */
-			while (size > 0) {
-				const uint8_t code = fgetc(fp);
-				const int count = (code & 0x3F) + 1;
-				if ((code & 0xC0) == 0xC0) {
-					/* transparent */
-				} else if ((code & 0x80) == 0x80) {
-					const uint8_t color = fgetc(fp);
-					for (int i = 0; i < count; ++i) {
-						rgba[offset + i] = palette[color];
-					}
-					--size;
-				} else {
-					for (int i = 0; i < count; ++i) {
-						const uint8_t color = fgetc(fp);
-						rgba[offset + i] = palette[color];
-					}
-					size -= count;
-				}
-				--size;
-				offset += count;
-			}
+			color_size = 1;
 			break;
 		case 0xC0012F9: /* rgba */
-			while (size > 0) {
-				const uint8_t code = fgetc(fp);
-				const int count = (code & 0x3F) + 1;
-				if ((code & 0xC0) == 0xC0) {
-					/* transparent */
-				} else if ((code & 0x80) == 0x80) {
-					const uint32_t color = fread_le32(fp);
-					for (int i = 0; i < count; ++i) {
-						rgba[offset + i] = color;
-					}
-					size -= 4;
-				} else {
-					for (int i = 0; i < count; ++i) {
-						const uint32_t color = fread_le32(fp);
-						rgba[offset + i] = color;
-					}
-					size -= count * 4;
-				}
-				--size;
-				offset += count;
-			}
+			color_size = 4;
 			break;
 		default:
 			fprintf(stderr, "Unsupported RLE format 0x%x\n", fmt);
-			break;
+			return rgba;
+		}
+		int offset = 0;
+		while (size > 0) {
+			const uint8_t code = *src++;
+			--size;
+			const int count = (code & 0x3F) + 1;
+			int len = 0;
+			if ((code & 0xC0) == 0x80) {
+				len = color_size;
+			} else if ((code & 0x80) == 0) {
+				len = count * color_size;
+			}
+			if (len > size || offset + count > w * h) {
+				fprintf(stderr, "Truncated RLE layer w:%d h:%d\n", w, h);
+				return rgba;
+			}
+			if ((code & 0xC0) == 0xC0) {
+				/* transparent */
+			} else if ((code & 0x80) == 0x80) {
+				const uint32_t color = read_color(src, color_size, palette);
+				for (int i = 0; i < count; ++i) {
+					rgba[offset + i] = color;
+				}
+			} else {
+				for (int i = 0; i < count; ++i) {
+					rgba[offset + i] = read_color(src + i * color_size, color_size, palette);
+				}
+			}
+			src += len;
+			size -= len;
+			offset += count;
 		}
 	}
 	// fprintf(stdout, "RLE remaining bytes %d\n", size);
@@ -71,6 +67,45 @@ static uint32_t *decode(FILE *fp, int size, int w, int h, int fmt, const uint32_
 	return rgba;
 }
 
+struct decode_job_t {
+	struct worker_job_t job;
+	struct layer_t *layer;
+	uint32_t fmt;
+	int size;
+	struct anim_stats_t *stats;
+	uint32_t palette[256];
+	uint8_t data[1];
+};
+
+static void decode_layer(void *param) {
+	struct decode_job_t *job = (struct decode_job_t *)param;
+	struct layer_t *layer = job->layer;
+	const uint32_t t0 = get_time_us();
+	layer->rgba = decode(job->data, job->size, layer->w, layer->h, job->fmt, job->palette);
+	if (job->stats) {
+		atomic_fetch_add(&job->stats->convert_time, get_time_us() - t0);
+	}
+	free(job);
+}
+
+static void queue_layer(FILE *fp, struct frame_t *frame, struct layer_t *layer, int size, uint32_t fmt, const uint32_t *palette, struct anim_stats_t *stats) {
+	struct decode_job_t *job = (struct decode_job_t *)malloc(sizeof(struct decode_job_t) + size);
+	if (!job) {
+		fprintf(stderr, "Failed to allocate %d bytes\n", (int)sizeof(struct decode_job_t) + size);
+		fseek(fp, size, SEEK_CUR);
+		return;
+	}
+	job->layer = layer;
+	job->fmt = fmt;
+	job->stats = stats;
+	job->size = fread(job->data, 1, size, fp);
+	memcpy(job->palette, palette, sizeof(job->palette));
+	job->job.proc = decode_layer;
+	job->job.param = job;
+	job->job.group = &frame->decoding;
+	Worker_Queue(&job->job);
+}
+
 int Animation_Load_RLE(FILE *fp, struct anim_t *anim, FreeFrameProc frameProc, FreeLayerProc layerProc) {
 	uint8_t buf[8];
 	fread(buf, 1, sizeof(buf), fp);
@@ -138,7 +173,7 @@ int Animation_Load_RLE(FILE *fp, struct anim_t *anim, FreeFrameProc frameProc, F
 				fread(layer_palette, sizeof(uint32_t), 256, fp);
 			}
 
-			layer->rgba = decode(fp, image_size, layer->w, layer->h, layer_fmt, (layer_flags & 1) ? layer_palette : palette);
+			queue_layer(fp, frame, layer, image_size, layer_fmt, (layer_flags & 1) ? layer_palette : palette, anim->stats);
 			layer->state = 1;
 		}
 	}
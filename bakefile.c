@@ -0,0 +1,296 @@
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "animation.h"
+#include "bakefile.h"
+
+struct bakefile_t {
+	uint8_t *data;
+	size_t size;
+	const struct bake_entry_t *entries;
+	int entries_count;
+};
+
+struct bakeentry_t {
+	char *name;
+	uint32_t offset;
+};
+
+struct bakewriter_t {
+	FILE *fp;
+	char path[MAXPATHLEN];
+	struct bake_header_t hdr;
+	struct bakeentry_t *entries;
+	int entries_count;
+};
+
+static void get_bake_path(const char *archive_path, char *buf, int size) {
+	const char *dir = getenv("BAKEPATH");
+	if (dir) {
+		const char *sep = strrchr(archive_path, '/');
+		snprintf(buf, size, "%s/%s.bake", dir, sep ? sep + 1 : archive_path);
+	} else {
+		snprintf(buf, size, "%s.bake", archive_path);
+	}
+}
+
+/* the tables and the pixels of an animation record are within the mapping */
+static int is_valid_animation(const uint8_t *data, size_t size, uint32_t offset) {
+	if ((offset & 3) != 0 || offset + (uint64_t)sizeof(struct bake_anim_t) > size) {
+		return 0;
+	}
+	const struct bake_anim_t *hdr = (const struct bake_anim_t *)(data + offset);
+	const uint64_t tables_size = sizeof(struct bake_anim_t) + (uint64_t)hdr->frames_count * sizeof(struct bake_frame_t) + (uint64_t)hdr->layers_count * sizeof(struct bake_layer_t);
+	if (offset + tables_size > size) {
+		return 0;
+	}
+	const struct bake_frame_t *frames = (const struct bake_frame_t *)(hdr + 1);
+	uint64_t layers_count = 0;
+	for (uint32_t i = 0; i < hdr->frames_count; ++i) {
+		layers_count += frames[i].layers_count;
+	}
+	if (layers_count != hdr->layers_count) {
+		return 0;
+	}
+	const struct bake_layer_t *layers = (const struct bake_layer_t *)(frames + hdr->frames_count);
+	for (uint32_t i = 0; i < hdr->layers_count; ++i) {
+		const struct bake_layer_t *layer = &layers[i];
+		if (layer->w < 0 || layer->h < 0) {
+			return 0;
+		}
+		if (layer->rgba_offset != 0) {
+			if ((layer->rgba_offset & 3) != 0 || layer->rgba_offset < tables_size) {
+				return 0;
+			}
+			if (offset + (uint64_t)layer->rgba_offset + (uint64_t)layer->w * layer->h * sizeof(uint32_t) > size) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* a truncated or stale file is rejected before any offset is used */
+static int is_valid(const uint8_t *data, size_t size, const struct stat *st) {
+	const struct bake_header_t *hdr = (const struct bake_header_t *)data;
+	if (size < sizeof(struct bake_header_t) || hdr->tag != BAKE_TAG || hdr->version != BAKE_VERSION) {
+		return 0;
+	}
+	if (hdr->archive_size != st->st_size || hdr->archive_mtime != get_mtime(st)) {
+		return 0;
+	}
+	if ((hdr->entries_offset & 3) != 0 || hdr->entries_offset + (uint64_t)hdr->entries_count * sizeof(struct bake_entry_t) > size) {
+		return 0;
+	}
+	const struct bake_entry_t *entries = (const struct bake_entry_t *)(data + hdr->entries_offset);
+	for (uint32_t i = 0; i < hdr->entries_count; ++i) {
+		const uint32_t name_offset = entries[i].name_offset;
+		if (name_offset >= size || !memchr(data + name_offset, 0, size - name_offset)) {
+			return 0;
+		}
+		if (!is_valid_animation(data, size, entries[i].anim_offset)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+struct bakefile_t *Bakefile_Open(const char *archive_path) {
+	struct stat st;
+	if (stat(archive_path, &st) != 0) {
+		return 0;
+	}
+	char path[MAXPATHLEN];
+	get_bake_path(archive_path, path, sizeof(path));
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	struct bakefile_t *bf = 0;
+	struct stat bake_st;
+	if (fstat(fd, &bake_st) == 0 && bake_st.st_size != 0) {
+		void *data = mmap(0, bake_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "Failed to map '%s'\n", path);
+		} else if (!is_valid((const uint8_t *)data, bake_st.st_size, &st)) {
+			fprintf(stderr, "Ignoring stale or truncated '%s'\n", path);
+			munmap(data, bake_st.st_size);
+		} else {
+			bf = (struct bakefile_t *)malloc(sizeof(struct bakefile_t));
+			if (!bf) {
+				munmap(data, bake_st.st_size);
+			} else {
+				const struct bake_header_t *hdr = (const struct bake_header_t *)data;
+				bf->data = (uint8_t *)data;
+				bf->size = bake_st.st_size;
+				bf->entries = (const struct bake_entry_t *)(bf->data + hdr->entries_offset);
+				bf->entries_count = hdr->entries_count;
+				fprintf(stdout, "Using %d baked animations from '%s'\n", bf->entries_count, path);
+			}
+		}
+	}
+	close(fd);
+	return bf;
+}
+
+void Bakefile_Close(struct bakefile_t *bf) {
+	munmap(bf->data, bf->size);
+	free(bf);
+}
+
+const uint8_t *Bakefile_Find(struct bakefile_t *bf, const char *name) {
+	int lo = 0;
+	int hi = bf->entries_count - 1;
+	while (lo <= hi) {
+		const int mid = (lo + hi) / 2;
+		const struct bake_entry_t *entry = &bf->entries[mid];
+		const int cmp = strcasecmp(name, (const char *)bf->data + entry->name_offset);
+		if (cmp == 0) {
+			return bf->data + entry->anim_offset;
+		} else if (cmp < 0) {
+			hi = mid - 1;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return 0;
+}
+
+static void write_padding(FILE *fp) {
+	static const uint8_t zero[BAKE_ALIGN];
+	const long pos = ftell(fp);
+	if ((pos & (BAKE_ALIGN - 1)) != 0) {
+		fwrite(zero, 1, BAKE_ALIGN - (pos & (BAKE_ALIGN - 1)), fp);
+	}
+}
+
+static uint32_t align(uint32_t offset) {
+	return (offset + BAKE_ALIGN - 1) & ~(BAKE_ALIGN - 1);
+}
+
+struct bakewriter_t *Bakefile_Create(const char *archive_path) {
+	struct stat st;
+	if (stat(archive_path, &st) != 0) {
+		fprintf(stderr, "Failed to stat '%s'\n", archive_path);
+		return 0;
+	}
+	struct bakewriter_t *bw = (struct bakewriter_t *)calloc(1, sizeof(struct bakewriter_t));
+	if (!bw) {
+		return 0;
+	}
+	get_bake_path(archive_path, bw->path, sizeof(bw->path));
+	char tmp_path[MAXPATHLEN + 4];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", bw->path);
+	bw->fp = fopen(tmp_path, "wb");
+	if (!bw->fp) {
+		fprintf(stderr, "Failed to open '%s'\n", tmp_path);
+		free(bw);
+		return 0;
+	}
+	bw->hdr.tag = BAKE_TAG;
+	bw->hdr.version = BAKE_VERSION;
+	bw->hdr.archive_size = st.st_size;
+	bw->hdr.archive_mtime = get_mtime(&st);
+	fwrite(&bw->hdr, sizeof(bw->hdr), 1, bw->fp);
+	return bw;
+}
+
+int Bakefile_AddAnimation(struct bakewriter_t *bw, const char *name, int anim) {
+	struct bakeentry_t *entries = (struct bakeentry_t *)realloc(bw->entries, (bw->entries_count + 1) * sizeof(struct bakeentry_t));
+	if (!entries) {
+		return -1;
+	}
+	bw->entries = entries;
+	write_padding(bw->fp);
+	const uint32_t offset = ftell(bw->fp);
+	entries[bw->entries_count].name = strdup(name);
+	entries[bw->entries_count].offset = offset;
+	++bw->entries_count;
+
+	struct bake_anim_t hdr;
+	hdr.frames_count = Animation_GetFramesCount(anim);
+	hdr.layers_count = 0;
+	for (int i = 0; i < hdr.frames_count; ++i) {
+		hdr.layers_count += Animation_GetFrameLayersCount(anim, i);
+	}
+	fwrite(&hdr, sizeof(hdr), 1, bw->fp);
+	for (int i = 0; i < hdr.frames_count; ++i) {
+		struct bake_frame_t frame;
+		frame.layers_count = Animation_GetFrameLayersCount(anim, i);
+		fwrite(&frame, sizeof(frame), 1, bw->fp);
+	}
+	uint32_t rgba_offset = align(sizeof(struct bake_anim_t) + hdr.frames_count * sizeof(struct bake_frame_t) + hdr.layers_count * sizeof(struct bake_layer_t));
+	for (int i = 0; i < hdr.frames_count; ++i) {
+		const int count = Animation_GetFrameLayersCount(anim, i);
+		for (int j = 0; j < count; ++j) {
+			const struct layer_t *layer = Animation_GetLayer(anim, i, j);
+			struct bake_layer_t l;
+			memset(&l, 0, sizeof(l));
+			l.x = layer->x;
+			l.y = layer->y;
+			l.w = layer->w;
+			l.h = layer->h;
+			l.mask = layer->mask;
+			memcpy(l.name, layer->name, sizeof(l.name));
+			if (layer->rgba) {
+				l.rgba_offset = rgba_offset;
+				rgba_offset = align(rgba_offset + layer->w * layer->h * sizeof(uint32_t));
+			}
+			fwrite(&l, sizeof(l), 1, bw->fp);
+		}
+	}
+	for (int i = 0; i < hdr.frames_count; ++i) {
+		const int count = Animation_GetFrameLayersCount(anim, i);
+		for (int j = 0; j < count; ++j) {
+			const struct layer_t *layer = Animation_GetLayer(anim, i, j);
+			if (layer->rgba) {
+				write_padding(bw->fp);
+				fwrite(layer->rgba, sizeof(uint32_t), layer->w * layer->h, bw->fp);
+			}
+		}
+	}
+	return 0;
+}
+
+static int compare_bakeentry(const void *a, const void *b) {
+	return strcasecmp(((const struct bakeentry_t *)a)->name, ((const struct bakeentry_t *)b)->name);
+}
+
+int Bakefile_Commit(struct bakewriter_t *bw) {
+	qsort(bw->entries, bw->entries_count, sizeof(struct bakeentry_t), compare_bakeentry);
+	struct bake_entry_t *table = (struct bake_entry_t *)malloc(bw->entries_count * sizeof(struct bake_entry_t));
+	if (table) {
+		for (int i = 0; i < bw->entries_count; ++i) {
+			table[i].name_offset = ftell(bw->fp);
+			table[i].anim_offset = bw->entries[i].offset;
+			fwrite(bw->entries[i].name, 1, strlen(bw->entries[i].name) + 1, bw->fp);
+		}
+		write_padding(bw->fp);
+		bw->hdr.entries_offset = ftell(bw->fp);
+		bw->hdr.entries_count = bw->entries_count;
+		fwrite(table, sizeof(struct bake_entry_t), bw->entries_count, bw->fp);
+		free(table);
+		fseek(bw->fp, 0, SEEK_SET);
+		fwrite(&bw->hdr, sizeof(bw->hdr), 1, bw->fp);
+	}
+	const int err = ferror(bw->fp);
+	fclose(bw->fp);
+	char tmp_path[MAXPATHLEN + 4];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", bw->path);
+	int ret = -1;
+	if (!table || err) {
+		fprintf(stderr, "Failed to write '%s'\n", tmp_path);
+		unlink(tmp_path);
+	} else if (rename(tmp_path, bw->path) == 0) {
+		ret = 0;
+	}
+	for (int i = 0; i < bw->entries_count; ++i) {
+		free(bw->entries[i].name);
+	}
+	free(bw->entries);
+	free(bw);
+	return ret;
+}
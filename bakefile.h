@@ -0,0 +1,53 @@
+
+#ifndef BAKEFILE_H__
+#define BAKEFILE_H__
+
+#include "intern.h"
+
+#define BAKE_TAG     0x4B414259 /* 'YBAK' */
+#define BAKE_VERSION 2
+#define BAKE_ALIGN   16
+
+struct bake_header_t {
+	uint32_t tag;
+	uint32_t version;
+	uint64_t archive_size;
+	uint64_t archive_mtime;
+	uint32_t entries_count;
+	uint32_t entries_offset;
+};
+
+struct bake_entry_t {
+	uint32_t name_offset;
+	uint32_t anim_offset;
+};
+
+/* an animation record is followed by its frames, layers and pixels tables */
+struct bake_anim_t {
+	uint32_t frames_count;
+	uint32_t layers_count;
+};
+
+struct bake_frame_t {
+	uint32_t layers_count;
+};
+
+struct bake_layer_t {
+	int32_t x, y, w, h;
+	uint32_t mask;
+	char name[64];
+	uint32_t rgba_offset; /* from the animation record */
+};
+
+struct bakefile_t;
+struct bakewriter_t;
+
+struct bakefile_t *Bakefile_Open(const char *archive_path);
+void Bakefile_Close(struct bakefile_t *bf);
+const uint8_t *Bakefile_Find(struct bakefile_t *bf, const char *name);
+
+struct bakewriter_t *Bakefile_Create(const char *archive_path);
+int Bakefile_AddAnimation(struct bakewriter_t *bw, const char *name, int anim);
+int Bakefile_Commit(struct bakewriter_t *bw);
+
+#endif
@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <sys/stat.h>
+#include <time.h>
 
 struct surface_t {
 	uint32_t *buffer;
@@ -75,6 +77,38 @@ static inline uint16_t fread_le16(FILE *fp) {
 	return READ_LE_UINT16(buf);
 }
 
+static inline int64_t get_time_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline uint32_t get_time_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline uint32_t get_time_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* the modification time of a file in nanoseconds, a rewrite within the same second is seen */
+static inline uint64_t get_mtime(const struct stat *st) {
+	return st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+/* FNV-1a, for the keys of the resource index and the access trace */
+static inline uint32_t hash_key(const char *key) {
+	uint32_t hash = 2166136261u;
+	for (; *key; ++key) {
+		hash = (hash ^ (uint8_t)*key) * 16777619u;
+	}
+	return hash;
+}
+
 static inline uint32_t blend(uint32_t a, uint32_t b, int balpha) {
 	const uint8_t alpha = ((b >> 24) * balpha) >> 8;
 	switch (alpha) {
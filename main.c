@@ -6,6 +6,7 @@
 #include "resource.h"
 #include "sys.h"
 #include "video.h"
+#include "worker.h"
 
 static const char *USAGE =
 	"Usage: DATAPATH=path/to/he/ %s path/to/.exe\n";
@@ -17,11 +18,31 @@ static void AudioSamplesCb(void *userdata, uint8_t *data, int len) {
 	Mixer_MixStereoS16((int16_t *)data, len / 4);
 }
 
-static void AudioLock(int flag) {
-	if (flag) {
-		System_LockAudio();
-	} else {
-		System_UnlockAudio();
+/* the mixer output is converted to AUDIOFREQ if set, 0 selects the rate of the audio device */
+static int GetAudioFreq() {
+	const char *freq = getenv("AUDIOFREQ");
+	if (freq) {
+		const int hz = atoi(freq);
+		return (hz > 0) ? hz : System_GetNativeAudioFreq();
+	}
+	return SYS_AUDIO_FREQ;
+}
+
+/* smaller buffers lower the latency of the sounds, the callback statistics are reported on exit */
+static int GetAudioSamples() {
+	const char *samples = getenv("AUDIOSAMPLES");
+	if (samples && atoi(samples) > 0) {
+		return atoi(samples);
+	}
+	return SYS_AUDIO_SAMPLES;
+}
+
+static void PrintAudioStats() {
+	struct mixer_stats_t stats;
+	Mixer_GetStats(&stats);
+	if (stats.callbacks != 0) {
+		fprintf(stdout, "Audio callbacks %d, interval %d us (max %d), duration %d us (max %d), %d underruns, %d streams starved\n",
+			stats.callbacks, stats.interval_avg, stats.interval_max, stats.duration_avg, stats.duration_max, stats.underruns, stats.starved);
 	}
 }
 
@@ -82,8 +103,15 @@ int main(int argc, char *argv[]) {
 		return 0;
 	}
 	System_Init();
-	Mixer_Init(22050, AudioLock);
-	System_StartAudio(AudioSamplesCb, 0);
+	Mixer_Init(SYS_AUDIO_FREQ);
+	int freq = GetAudioFreq();
+	int samples = GetAudioSamples();
+	if (System_OpenAudio(&freq, &samples, AudioSamplesCb, 0) == 0) {
+		fprintf(stdout, "Audio device %d Hz, %d samples\n", freq, samples);
+		Mixer_SetOutput(freq, samples);
+		System_StartAudio();
+	}
+	Worker_Init();
 	Animation_Init();
 	Font_Init();
 	Video_Init();
@@ -99,6 +127,9 @@ int main(int argc, char *argv[]) {
 	Video_Fini();
 	Font_Fini();
 	Animation_Fini();
+	Worker_Fini();
+	System_StopAudio();
+	PrintAudioStats();
 	Mixer_Fini();
 	System_Fini();
 	return 0;
@@ -0,0 +1,135 @@
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <unistd.h>
+#include "memory.h"
+
+/* the allocation size is stored before the returned pointer */
+#define HEADER_SIZE sizeof(max_align_t)
+
+static atomic_llong _used[MEMORY_TOTAL];
+static atomic_llong _budgets[MEMORY_TOTAL + 1];
+
+void Memory_Add(int category, int64_t size) {
+	assert(category >= 0 && category < MEMORY_TOTAL);
+	atomic_fetch_add(&_used[category], size);
+}
+
+int64_t Memory_GetUsed(int category) {
+	if (category == MEMORY_TOTAL) {
+		int64_t total = 0;
+		for (int i = 0; i < MEMORY_TOTAL; ++i) {
+			total += atomic_load(&_used[i]);
+		}
+		return total;
+	}
+	assert(category >= 0 && category < MEMORY_TOTAL);
+	return atomic_load(&_used[category]);
+}
+
+void Memory_SetBudget(int category, int64_t size) {
+	assert(category >= 0 && category <= MEMORY_TOTAL);
+	atomic_store(&_budgets[category], size);
+}
+
+int64_t Memory_GetBudget(int category) {
+	assert(category >= 0 && category <= MEMORY_TOTAL);
+	return atomic_load(&_budgets[category]);
+}
+
+static atomic_int _overshoot_reported[MEMORY_TOTAL];
+
+/* evicting from one category cannot always compensate for the others, the caches would be emptied for nothing */
+int Memory_IsOverBudget(int category, int64_t evictable_size) {
+	assert(category >= 0 && category < MEMORY_TOTAL);
+	const int64_t budget = Memory_GetBudget(category);
+	if (budget != 0 && Memory_GetUsed(category) > budget) {
+		return 1;
+	}
+	const int64_t total_budget = Memory_GetBudget(MEMORY_TOTAL);
+	const int64_t overshoot = (total_budget != 0) ? Memory_GetUsed(MEMORY_TOTAL) - total_budget : 0;
+	if (overshoot <= 0) {
+		atomic_store(&_overshoot_reported[category], 0);
+		return 0;
+	}
+	if (overshoot <= evictable_size) {
+		return 1;
+	}
+	if (!atomic_exchange(&_overshoot_reported[category], 1)) {
+		fprintf(stderr, "Memory over budget by %lld bytes, category %d can only release %lld bytes\n", (long long)overshoot, category, (long long)evictable_size);
+	}
+	return 0;
+}
+
+void *Memory_Alloc(int category, size_t size) {
+	uint8_t *p = (uint8_t *)malloc(HEADER_SIZE + size);
+	if (!p) {
+		return 0;
+	}
+	*(size_t *)p = size;
+	Memory_Add(category, size);
+	return p + HEADER_SIZE;
+}
+
+void *Memory_Realloc(int category, void *ptr, size_t size) {
+	if (!ptr) {
+		return Memory_Alloc(category, size);
+	}
+	uint8_t *p = (uint8_t *)ptr - HEADER_SIZE;
+	const size_t prev_size = *(size_t *)p;
+	p = (uint8_t *)realloc(p, HEADER_SIZE + size);
+	if (!p) {
+		return 0;
+	}
+	*(size_t *)p = size;
+	Memory_Add(category, (int64_t)size - (int64_t)prev_size);
+	return p + HEADER_SIZE;
+}
+
+void Memory_Free(int category, void *ptr) {
+	if (ptr) {
+		uint8_t *p = (uint8_t *)ptr - HEADER_SIZE;
+		Memory_Add(category, -(int64_t)*(size_t *)p);
+		free(p);
+	}
+}
+
+static int64_t read_meminfo(FILE *fp, const char *name) {
+	char line[128];
+	const int len = strlen(name);
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, name, len) == 0 && line[len] == ':') {
+			return strtoll(line + len + 1, 0, 10) * 1024;
+		}
+	}
+	return 0;
+}
+
+/* the system values are capped by the total budget when set */
+void Memory_GetSystemInfo(int64_t *total, int64_t *avail) {
+	*total = *avail = 0;
+	FILE *fp = fopen("/proc/meminfo", "r");
+	if (fp) {
+		*total = read_meminfo(fp, "MemTotal");
+		*avail = read_meminfo(fp, "MemAvailable");
+		fclose(fp);
+	}
+	const int64_t page_size = sysconf(_SC_PAGESIZE);
+	if (*total == 0) {
+		*total = sysconf(_SC_PHYS_PAGES) * page_size;
+	}
+	if (*avail == 0) {
+		*avail = sysconf(_SC_AVPHYS_PAGES) * page_size;
+	}
+	const int64_t budget = Memory_GetBudget(MEMORY_TOTAL);
+	if (budget != 0) {
+		const int64_t left = budget - Memory_GetUsed(MEMORY_TOTAL);
+		if (*total > budget) {
+			*total = budget;
+		}
+		if (*avail > left) {
+			*avail = (left < 0) ? 0 : left;
+		}
+	}
+}
@@ -0,0 +1,35 @@
+
+#ifndef MEMORY_H__
+#define MEMORY_H__
+
+#include "intern.h"
+
+enum {
+	MEMORY_LAYERS = 0, /* decoded animation pixels */
+	MEMORY_ZIPFILES,   /* archive indexes, readers and inflate states */
+	MEMORY_AUDIO,      /* sound decoders */
+	MEMORY_VIDEO,      /* video decoder and frames, estimated from the picture size */
+	MEMORY_IMAGES,     /* screen buffer the scripts draw to */
+	MEMORY_TOTAL
+};
+
+/* the counters can be updated from any thread */
+
+void Memory_Add(int category, int64_t size);
+int64_t Memory_GetUsed(int category);
+
+/* a budget of 0 disables the limit, MEMORY_TOTAL applies to the sum of all the categories */
+
+void Memory_SetBudget(int category, int64_t size);
+int64_t Memory_GetBudget(int category);
+
+/* the total budget only counts when releasing the evictable bytes of the category brings the total back under it */
+int Memory_IsOverBudget(int category, int64_t evictable_size);
+
+void *Memory_Alloc(int category, size_t size);
+void *Memory_Realloc(int category, void *ptr, size_t size);
+void Memory_Free(int category, void *ptr);
+
+void Memory_GetSystemInfo(int64_t *total, int64_t *avail);
+
+#endif // MEMORY_H__
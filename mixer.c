@@ -1,5 +1,15 @@
 
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "memory.h"
 #include "mixer.h"
+#include "resampler.h"
 
 #define DR_MP3_IMPLEMENTATION
 #define DR_MP3_NO_STDIO
@@ -10,16 +20,85 @@
 #include "dr_wav.h"
 
 #define MAX_CHANNELS 16
+#define MAX_SOUNDS   64
+
+/* streams are decoded ahead of the playback, 371 ms at 22050 Hz */
+#define RING_FRAMES 8192
+
+#define MAX_COMMANDS 256
+
+/* the channels are added in a float bus, MIX_FRAMES at a time */
+#define MIX_FRAMES 256
+
+/* 2.9 ms at 22050 Hz, about -1 dB */
+#define LIMITER_LOOKAHEAD 64
+#define LIMITER_THRESHOLD 29000.f
+#define LIMITER_RELEASE   0.1f /* seconds */
+
+/* 32 analysis blocks of MIX_FRAMES, more than the device latency */
+#define VISEMES_HISTORY 32
+#define VOICE_ENVELOPE_DECAY 0.5f /* seconds */
+
+/* one seek point every 2 seconds of a 5 minutes MP3 */
+#define MAX_SEEK_POINTS 150
+
+#define MIN_SOURCE_HZ 4000
+#define MAX_SOURCE_HZ 96000
+
+#define DEFAULT_SOUND_CACHE_SIZE  (4 * 1024 * 1024)
+#define DEFAULT_SOUND_MAX_LENGTH  2000 /* ms */
+
+/* Q14 gains, a full scale change is ramped over 256 frames */
+#define GAIN_ONE  (1 << 14)
+#define RAMP_STEP (GAIN_ONE / 64)
 
 enum {
 	TAG_ID3  = 0x49443303,
 	TAG_RIFF = 0x52494646
 };
 
+/* the channels are owned by the script thread while free or released, by the audio callback otherwise */
+enum {
+	CHANNEL_FREE = 0,
+	CHANNEL_STARTING, /* play command queued */
+	CHANNEL_PLAYING,
+	CHANNEL_ENDED,    /* played until the end, not yet stopped */
+	CHANNEL_STOPPING, /* stopped, still referenced by the callback */
+	CHANNEL_RELEASED  /* to be reused */
+};
+
+enum {
+	CMD_PLAY,
+	CMD_SET_GAINS
+};
+
 enum {
 	TYPE_UNKNOWN = 0,
 	TYPE_MP3,
-	TYPE_WAV
+	TYPE_WAV,
+	TYPE_PCM
+};
+
+struct mixer_sound_t {
+	char *key;
+	int16_t *samples; /* 0 if too long to be cached */
+	int frames_count;
+	int stereo;
+	drmp3_seek_point *seek_points; /* looped MP3 streams */
+	int seek_points_count;
+	int size;
+	int refs;
+	uint32_t last_used;
+};
+
+/* analysis state of the lipsync voices, owned by the audio callback */
+struct mixer_voice_t {
+	float low, high; /* one pole lowpass states */
+	float envelope;
+	float energy;
+	float last;
+	int frames;
+	int count;
 };
 
 struct mixer_channel_t {
@@ -30,13 +109,105 @@ struct mixer_channel_t {
 		drmp3 mp3;
 		drwav wav;
 	} state;
-	struct mixer_channel_t *next;
+	int hz;
+	bool resampling;
+	struct resampler_t resampler;
+	struct mixer_sound_t *sound;
+	int position;
+	int64_t decoded; /* source frames */
+	bool loop;
+	int loop_start, loop_end; /* mixer frames, source frames for the streams */
+	atomic_int status;
+	/* protected by _decode_lock, the stream is read without the lock while filling is set */
+	bool decoding;
+	bool filling;
+	/* single producer (decoder thread), single consumer (audio callback) */
+	atomic_uint ring_read;
+	atomic_uint ring_write;
+	atomic_bool ring_eos;
+	int16_t ring[RING_FRAMES * 2];
+	/* the scheduled channels are in the playing list, waiting for their start time or the channel they follow */
+	int64_t start_time;
+	int after;
+	uint32_t after_generation;
+	atomic_uint generation; /* incremented at each play, the slot of an ended sound can be reused by the time it is followed */
+	struct mixer_channel_t *follows; /* owned by the audio callback */
+	bool started;
+	bool listed;
+	int64_t mixed_block;
+	atomic_llong start_frame; /* bus frame of the first sample */
+	atomic_int frames_mixed;
+	/* mouth shapes estimated from the voice, (position << 8) | viseme */
+	atomic_bool lipsync;
+	atomic_llong visemes[VISEMES_HISTORY];
+	struct mixer_voice_t voice;
+	float volume;
+	float pan;
+	int gain_l, gain_r;
+	int target_l, target_r;
+	struct mixer_channel_t *next; /* free or playing list */
+};
+
+struct mixer_command_t {
+	int type;
+	int channel;
+	int gain_l, gain_r;
 };
 
 static struct mixer_channel_t _channels[MAX_CHANNELS];
 static struct mixer_channel_t *_next_channel;
+static struct mixer_channel_t *_playing_channels;
 static int _hz;
-static MixerLockProc _lock;
+static int _resampler_quality = RESAMPLER_SINC_SHORT;
+static int _output_hz;
+static int _output_samples;
+static bool _output_opened; /* without a device, no callback consumes the commands or releases the channels */
+static struct resampler_t _output_resampler;
+
+/* updated by the audio callback, the sequence is odd while the values are written */
+static atomic_uint _clock_seq;
+static atomic_llong _clock_time;
+static atomic_llong _clock_frames; /* device frames written before the last callback */
+static atomic_llong _clock_mixed; /* bus frames mixed at the end of the last callback */
+
+/* written by the audio callback, times in nanoseconds */
+static atomic_int _stats_callbacks;
+static atomic_llong _stats_interval_sum;
+static atomic_llong _stats_interval_max;
+static atomic_llong _stats_duration_sum;
+static atomic_llong _stats_duration_max;
+static atomic_int _stats_underruns;
+static atomic_int _stats_starved;
+
+/* owned by the audio callback */
+static int64_t _callback_time;
+static int64_t _device_frames;
+static int64_t _bus_frames;
+static float _bus[MIX_FRAMES * 2];
+static float _limiter_frames[LIMITER_LOOKAHEAD * 2];
+static float _limiter_levels[LIMITER_LOOKAHEAD];
+static int _limiter_pos;
+static float _limiter_gain;
+static float _limiter_release;
+static float _voice_low_coef;
+static float _voice_high_coef;
+static bool _refill;
+
+/* single producer (script thread), single consumer (audio callback) */
+static struct mixer_command_t _commands[MAX_COMMANDS];
+static atomic_uint _commands_read;
+static atomic_uint _commands_write;
+
+static struct mixer_sound_t _sounds[MAX_SOUNDS];
+static int _sound_cache_size = DEFAULT_SOUND_CACHE_SIZE;
+static int _sound_max_length = DEFAULT_SOUND_MAX_LENGTH;
+static uint32_t _sound_counter;
+
+static pthread_t _decode_thread;
+static pthread_mutex_t _decode_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _decode_cond = PTHREAD_COND_INITIALIZER;
+static sem_t _decode_sem;
+static bool _decode_quit;
 
 static struct mixer_channel_t *find_free_channel() {
 	struct mixer_channel_t *channel = _next_channel;
@@ -54,17 +225,219 @@ static void free_channel(struct mixer_channel_t *channel) {
 	_next_channel = channel;
 }
 
-int Mixer_Init(int hz, MixerLockProc lock) {
-	_hz = hz;
-	_next_channel = &_channels[0];
-	for (int i = 0; i < MAX_CHANNELS - 1; ++i) {
-		_channels[i].next = &_channels[i + 1];
+static int push_command(int type, struct mixer_channel_t *channel) {
+	if (!_output_opened) {
+		return 0;
+	}
+	const uint32_t write = atomic_load_explicit(&_commands_write, memory_order_relaxed);
+	const uint32_t read = atomic_load_explicit(&_commands_read, memory_order_acquire);
+	if (write - read == MAX_COMMANDS) {
+		fprintf(stderr, "Mixer commands queue is full\n");
+		return -1;
 	}
-	_lock = lock;
+	struct mixer_command_t *cmd = &_commands[write & (MAX_COMMANDS - 1)];
+	cmd->type = type;
+	cmd->channel = channel - _channels;
+	/* balance, both sides are at full volume when centered */
+	const float l = (channel->pan > 0) ? 1.f - channel->pan : 1.f;
+	const float r = (channel->pan < 0) ? 1.f + channel->pan : 1.f;
+	cmd->gain_l = (int)(channel->volume * l * GAIN_ONE);
+	cmd->gain_r = (int)(channel->volume * r * GAIN_ONE);
+	atomic_store_explicit(&_commands_write, write + 1, memory_order_release);
 	return 0;
 }
 
-int Mixer_Fini() {
+static void add_playing_channel(struct mixer_channel_t *channel) {
+	channel->next = _playing_channels;
+	_playing_channels = channel;
+	channel->listed = true;
+}
+
+static void remove_playing_channel(struct mixer_channel_t *channel) {
+	for (struct mixer_channel_t **p = &_playing_channels; *p; p = &(*p)->next) {
+		if (*p == channel) {
+			*p = channel->next;
+			channel->next = 0;
+			channel->listed = false;
+			break;
+		}
+	}
+}
+
+/* short sounds are decoded once, the least recently played are discarded above the cache size */
+
+static struct mixer_sound_t *find_sound(const char *key) {
+	for (int i = 0; i < MAX_SOUNDS; ++i) {
+		if (_sounds[i].key && strcmp(_sounds[i].key, key) == 0) {
+			return &_sounds[i];
+		}
+	}
+	return 0;
+}
+
+static void free_sound(struct mixer_sound_t *sound) {
+	Memory_Free(MEMORY_AUDIO, sound->samples);
+	Memory_Free(MEMORY_AUDIO, sound->seek_points);
+	free(sound->key);
+	memset(sound, 0, sizeof(struct mixer_sound_t));
+}
+
+static int evict_sound() {
+	struct mixer_sound_t *lru = 0;
+	for (int i = 0; i < MAX_SOUNDS; ++i) {
+		struct mixer_sound_t *sound = &_sounds[i];
+		if (sound->key && sound->refs == 0) {
+			if (!lru || (int32_t)(sound->last_used - lru->last_used) < 0) {
+				lru = sound;
+			}
+		}
+	}
+	if (lru) {
+		free_sound(lru);
+		return 1;
+	}
+	return 0;
+}
+
+static int get_cached_size() {
+	int size = 0;
+	for (int i = 0; i < MAX_SOUNDS; ++i) {
+		size += _sounds[i].size;
+	}
+	return size;
+}
+
+static int get_evictable_size() {
+	int size = 0;
+	for (int i = 0; i < MAX_SOUNDS; ++i) {
+		if (_sounds[i].refs == 0) {
+			size += _sounds[i].size;
+		}
+	}
+	return size;
+}
+
+static void trim_sounds() {
+	while ((get_cached_size() > _sound_cache_size || Memory_IsOverBudget(MEMORY_AUDIO, get_evictable_size())) && evict_sound());
+}
+
+/* the sounds too long to be cached are also recorded, to be streamed without decoding them first */
+static struct mixer_sound_t *add_sound(const char *key, int16_t *samples, int frames_count, int stereo) {
+	struct mixer_sound_t *sound = 0;
+	do {
+		for (int i = 0; i < MAX_SOUNDS; ++i) {
+			if (!_sounds[i].key) {
+				sound = &_sounds[i];
+				break;
+			}
+		}
+	} while (!sound && evict_sound());
+	if (!sound || !(sound->key = strdup(key))) {
+		fprintf(stderr, "Failed to cache sound '%s'\n", key);
+		Memory_Free(MEMORY_AUDIO, samples);
+		return 0;
+	}
+	sound->samples = samples;
+	sound->frames_count = frames_count;
+	sound->stereo = stereo;
+	sound->size = samples ? frames_count * (stereo ? 2 : 1) * sizeof(int16_t) : 0;
+	sound->last_used = ++_sound_counter;
+	return sound;
+}
+
+/* the decoders allocations are accounted to the audio memory */
+
+static void *ChannelMallocProc(size_t sz, void *pUserData) {
+	return Memory_Alloc(MEMORY_AUDIO, sz);
+}
+
+static void *ChannelReallocProc(void *p, size_t sz, void *pUserData) {
+	return Memory_Realloc(MEMORY_AUDIO, p, sz);
+}
+
+static void ChannelFreeProc(void *p, void *pUserData) {
+	Memory_Free(MEMORY_AUDIO, p);
+}
+
+static const drmp3_allocation_callbacks _mp3_allocation_callbacks = {
+	0, ChannelMallocProc, ChannelReallocProc, ChannelFreeProc
+};
+
+static const drwav_allocation_callbacks _wav_allocation_callbacks = {
+	0, ChannelMallocProc, ChannelReallocProc, ChannelFreeProc
+};
+
+static void uninit_channel(struct mixer_channel_t *channel) {
+	switch (channel->type) {
+	case TYPE_MP3:
+		drmp3_uninit(&channel->state.mp3);
+		break;
+	case TYPE_WAV:
+		drwav_uninit(&channel->state.wav);
+		break;
+	}
+	/* the streams reference their sound while using its seek table */
+	if (channel->sound) {
+		--channel->sound->refs;
+		channel->sound = 0;
+	}
+	channel->type = TYPE_UNKNOWN;
+	channel->fp = 0;
+	channel->resampling = false;
+	channel->loop = false;
+}
+
+/* the channels released by the audio callback are returned to the free list */
+static void reclaim_channels() {
+	bool reclaimed = false;
+	for (int i = 0; i < MAX_CHANNELS; ++i) {
+		struct mixer_channel_t *channel = &_channels[i];
+		if (atomic_load_explicit(&channel->status, memory_order_acquire) == CHANNEL_RELEASED) {
+			/* the decoder thread may still be reading the stream it was stopped in the middle of */
+			pthread_mutex_lock(&_decode_lock);
+			while (channel->filling) {
+				pthread_cond_wait(&_decode_cond, &_decode_lock);
+			}
+			pthread_mutex_unlock(&_decode_lock);
+			uninit_channel(channel);
+			free_channel(channel);
+			atomic_store_explicit(&channel->status, CHANNEL_FREE, memory_order_relaxed);
+			reclaimed = true;
+		}
+	}
+	if (reclaimed) {
+		trim_sounds();
+	}
+}
+
+void Mixer_SetSoundCache(int size, int max_length) {
+	_sound_cache_size = size;
+	_sound_max_length = max_length;
+	trim_sounds();
+}
+
+/* called when the memory budgets change */
+void Mixer_TrimCache() {
+	trim_sounds();
+}
+
+/* called before the audio device is started, the output is a single stream and can afford the long filter */
+void Mixer_SetOutput(int hz, int samples) {
+	_output_opened = true;
+	_output_hz = _hz;
+	_output_samples = samples;
+	if (hz > 0 && hz != _hz && Resampler_Init(&_output_resampler, RESAMPLER_SINC_LONG, 2, _hz, hz)) {
+		_output_hz = hz;
+	}
+}
+
+/* applies to the sounds played afterwards, the cached samples are kept */
+int Mixer_SetResamplerQuality(int quality) {
+	if (!Resampler_IsValidQuality(quality)) {
+		fprintf(stderr, "Unsupported resampler quality %d\n", quality);
+		return -1;
+	}
+	_resampler_quality = quality;
 	return 0;
 }
 
@@ -93,94 +466,846 @@ static drwav_bool32 WavChannelSeekProc(void *pUserData, int offset, drwav_seek_o
 	return 0;
 }
 
-int Mixer_PlayMp3(FILE *fp) {
-	int num = -1;
-	_lock(1);
-	struct mixer_channel_t *channel = find_free_channel();
-	if (channel) {
-		channel->fp = fp;
-		channel->type = TYPE_MP3;
-		drmp3_init(&channel->state.mp3, ChannelReadProc, Mp3ChannelSeekProc, channel, 0);
-		if (channel->state.mp3.sampleRate != _hz) {
-			fprintf(stderr, "Unsupported sample rate %d for MP3\n", channel->state.mp3.sampleRate);
-			free_channel(channel);
-		} else {
-			channel->stereo = (channel->state.mp3.channels == 2);
-			num = channel - _channels;
+static int init_decoder(struct mixer_channel_t *channel) {
+	int hz = 0;
+	switch (channel->type) {
+	case TYPE_MP3:
+		drmp3_init(&channel->state.mp3, ChannelReadProc, Mp3ChannelSeekProc, channel, &_mp3_allocation_callbacks);
+		channel->stereo = (channel->state.mp3.channels == 2);
+		hz = channel->state.mp3.sampleRate;
+		break;
+	case TYPE_WAV:
+		drwav_init(&channel->state.wav, ChannelReadProc, WavChannelSeekProc, channel, &_wav_allocation_callbacks);
+		channel->stereo = (channel->state.wav.channels == 2);
+		hz = channel->state.wav.sampleRate;
+		break;
+	}
+	if (hz < MIN_SOURCE_HZ || hz > MAX_SOURCE_HZ) {
+		fprintf(stderr, "Unsupported sample rate %d for %s\n", hz, (channel->type == TYPE_MP3) ? "MP3" : "WAV");
+		return -1;
+	}
+	channel->hz = hz;
+	channel->decoded = 0;
+	/* the streams are converted to the output rate when decoded, the cached samples and the rings are at _hz */
+	channel->resampling = (hz != _hz);
+	if (channel->resampling && !Resampler_Init(&channel->resampler, _resampler_quality, channel->stereo ? 2 : 1, hz, _hz)) {
+		return -1;
+	}
+	return 0;
+}
+
+static int read_decoder(struct mixer_channel_t *channel, int16_t *buffer, int count) {
+	int frames = 0;
+	switch (channel->type) {
+	case TYPE_MP3:
+		frames = drmp3_read_pcm_frames_s16(&channel->state.mp3, count, buffer);
+		break;
+	case TYPE_WAV:
+		frames = drwav_read_pcm_frames_s16(&channel->state.wav, count, buffer);
+		break;
+	}
+	channel->decoded += frames;
+	return frames;
+}
+
+static void seek_decoder(struct mixer_channel_t *channel, int frame) {
+	switch (channel->type) {
+	case TYPE_MP3:
+		drmp3_seek_to_pcm_frame(&channel->state.mp3, frame);
+		break;
+	case TYPE_WAV:
+		drwav_seek_to_pcm_frame(&channel->state.wav, frame);
+		break;
+	}
+	channel->decoded = frame;
+}
+
+/* the loops are joined before the resampler, its filter runs across the loop point */
+static int decode_frames(void *param, int16_t *buffer, int count) {
+	struct mixer_channel_t *channel = (struct mixer_channel_t *)param;
+	if (!channel->loop) {
+		return read_decoder(channel, buffer, count);
+	}
+	const int step = channel->stereo ? 2 : 1;
+	int frames = 0;
+	bool looped = false;
+	while (frames < count) {
+		int len = count - frames;
+		if (channel->loop_end != 0) {
+			len = MIN(len, channel->loop_end - channel->decoded);
+		}
+		const int n = (len > 0) ? read_decoder(channel, buffer + frames * step, len) : 0;
+		if (n == 0) {
+			/* nothing between the loop points */
+			if (looped) {
+				break;
+			}
+			seek_decoder(channel, channel->loop_start);
+			looped = true;
+			continue;
+		}
+		frames += n;
+		looped = false;
+	}
+	return frames;
+}
+
+static int read_frames(struct mixer_channel_t *channel, int count, int16_t *buffer) {
+	if (channel->resampling) {
+		return Resampler_Read(&channel->resampler, buffer, count, decode_frames, channel);
+	}
+	return decode_frames(channel, buffer, count);
+}
+
+static void rewind_decoder(struct mixer_channel_t *channel) {
+	seek_decoder(channel, 0);
+	if (channel->resampling) {
+		Resampler_Reset(&channel->resampler);
+	}
+}
+
+/* called from the decoder thread, or before the channel is mixed */
+static void fill_ring(struct mixer_channel_t *channel) {
+	const int step = channel->stereo ? 2 : 1;
+	uint32_t write = atomic_load_explicit(&channel->ring_write, memory_order_relaxed);
+	const uint32_t read = atomic_load_explicit(&channel->ring_read, memory_order_acquire);
+	int space = RING_FRAMES - (write - read);
+	while (space > 0) {
+		const int offset = write & (RING_FRAMES - 1);
+		const int len = MIN(space, RING_FRAMES - offset);
+		const int count = read_frames(channel, len, channel->ring + offset * step);
+		write += count;
+		space -= count;
+		atomic_store_explicit(&channel->ring_write, write, memory_order_release);
+		if (count < len) {
+			atomic_store_explicit(&channel->ring_eos, true, memory_order_release);
+			break;
+		}
+	}
+}
+
+static void *decode_thread_proc(void *arg) {
+	while (1) {
+		sem_wait(&_decode_sem);
+		pthread_mutex_lock(&_decode_lock);
+		const bool quit = _decode_quit;
+		pthread_mutex_unlock(&_decode_lock);
+		if (quit) {
+			break;
+		}
+		/* the lock is only held to check the flags, the script thread only waits for the channel it stops */
+		for (int i = 0; i < MAX_CHANNELS; ++i) {
+			struct mixer_channel_t *channel = &_channels[i];
+			pthread_mutex_lock(&_decode_lock);
+			const bool filling = channel->filling = channel->decoding;
+			pthread_mutex_unlock(&_decode_lock);
+			if (!filling) {
+				continue;
+			}
+			fill_ring(channel);
+			pthread_mutex_lock(&_decode_lock);
+			channel->filling = false;
+			if (atomic_load(&channel->ring_eos)) {
+				channel->decoding = false;
+			}
+			pthread_cond_broadcast(&_decode_cond);
+			pthread_mutex_unlock(&_decode_lock);
+		}
+	}
+	return 0;
+}
+
+int Mixer_Init(int hz) {
+	_hz = _output_hz = hz;
+	memset(_limiter_frames, 0, sizeof(_limiter_frames));
+	for (int i = 0; i < LIMITER_LOOKAHEAD; ++i) {
+		_limiter_levels[i] = 1.f;
+	}
+	_limiter_pos = 0;
+	_limiter_gain = 1.f;
+	_limiter_release = 1.f - expf(-1.f / (LIMITER_RELEASE * hz));
+	_voice_low_coef = 1.f - expf(-2.f * M_PI * 800.f / hz);
+	_voice_high_coef = 1.f - expf(-2.f * M_PI * 3000.f / hz);
+	_next_channel = &_channels[0];
+	for (int i = 0; i < MAX_CHANNELS - 1; ++i) {
+		_channels[i].next = &_channels[i + 1];
+	}
+	sem_init(&_decode_sem, 0, 0);
+	_decode_quit = false;
+	if (pthread_create(&_decode_thread, 0, decode_thread_proc, 0) != 0) {
+		fprintf(stderr, "Failed to create audio decoder thread\n");
+		return -1;
+	}
+	return 0;
+}
+
+int Mixer_Fini() {
+	pthread_mutex_lock(&_decode_lock);
+	_decode_quit = true;
+	pthread_mutex_unlock(&_decode_lock);
+	sem_post(&_decode_sem);
+	pthread_join(_decode_thread, 0);
+	sem_destroy(&_decode_sem);
+	/* the audio device is closed at that point */
+	_playing_channels = 0;
+	for (int i = 0; i < MAX_CHANNELS; ++i) {
+		struct mixer_channel_t *channel = &_channels[i];
+		channel->decoding = false;
+		channel->listed = false;
+		uninit_channel(channel);
+		atomic_store(&channel->status, CHANNEL_FREE);
+	}
+	for (int i = 0; i < MAX_SOUNDS; ++i) {
+		if (_sounds[i].key) {
+			free_sound(&_sounds[i]);
+		}
+	}
+	Resampler_FreeTables();
+	return 0;
+}
+
+/* returns the samples if the sound is shorter than the maximum length, the decoder is rewound otherwise */
+static int16_t *decode_sound(struct mixer_channel_t *channel, int *frames_count) {
+	const int max_frames = (int64_t)_sound_max_length * _hz / 1000;
+	if (channel->type == TYPE_WAV && channel->state.wav.totalPCMFrameCount * _hz > (uint64_t)max_frames * channel->state.wav.sampleRate) {
+		return 0;
+	}
+	const int frame_size = (channel->stereo ? 2 : 1) * sizeof(int16_t);
+	int16_t *samples = (int16_t *)Memory_Alloc(MEMORY_AUDIO, (max_frames + 1) * frame_size);
+	if (!samples) {
+		return 0;
+	}
+	const int count = read_frames(channel, max_frames + 1, samples);
+	if (count == 0 || count > max_frames) {
+		Memory_Free(MEMORY_AUDIO, samples);
+		rewind_decoder(channel);
+		return 0;
+	}
+	*frames_count = count;
+	int16_t *p = (int16_t *)Memory_Realloc(MEMORY_AUDIO, samples, count * frame_size);
+	return p ? p : samples;
+}
+
+static float clamp_volume(float volume) {
+	return (volume < 0.f) ? 0.f : ((volume > 1.f) ? 1.f : volume);
+}
+
+static float clamp_pan(float pan) {
+	return (pan < -1.f) ? -1.f : ((pan > 1.f) ? 1.f : pan);
+}
+
+/* the table is computed once per sound, the MP3 loops are then seeked from the closest frame instead of the start */
+static void bind_seek_table(struct mixer_channel_t *channel, struct mixer_sound_t *sound) {
+	if (!sound->seek_points) {
+		drmp3_uint32 count = MAX_SEEK_POINTS;
+		drmp3_seek_point *points = (drmp3_seek_point *)Memory_Alloc(MEMORY_AUDIO, count * sizeof(drmp3_seek_point));
+		if (!points) {
+			return;
+		}
+		if (!drmp3_calculate_seek_points(&channel->state.mp3, &count, points) || count == 0) {
+			fprintf(stderr, "Failed to calculate seek points for '%s'\n", sound->key);
+			Memory_Free(MEMORY_AUDIO, points);
+			return;
 		}
+		drmp3_seek_point *p = (drmp3_seek_point *)Memory_Realloc(MEMORY_AUDIO, points, count * sizeof(drmp3_seek_point));
+		sound->seek_points = p ? p : points;
+		sound->seek_points_count = count;
+		sound->size += count * sizeof(drmp3_seek_point);
+	}
+	if (drmp3_bind_seek_table(&channel->state.mp3, sound->seek_points_count, sound->seek_points)) {
+		channel->sound = sound;
+		++sound->refs;
 	}
-	_lock(0);
-	return num;
 }
 
-int Mixer_PlayWav(FILE *fp) {
-	int num = -1;
-	_lock(1);
+/* the mixer functions are called from the script thread, they never wait for the audio callback */
+
+static int play_sound(FILE *fp, const char *key, int type, const struct mixer_play_t *play) {
+	reclaim_channels();
 	struct mixer_channel_t *channel = find_free_channel();
-	if (channel) {
+	if (!channel) {
+		return -1;
+	}
+	struct mixer_sound_t *sound = key ? find_sound(key) : 0;
+	if (!sound || !sound->samples) {
 		channel->fp = fp;
-		channel->type = TYPE_WAV;
-		drwav_init(&channel->state.wav, ChannelReadProc, WavChannelSeekProc, channel, 0);
-		if (channel->state.wav.sampleRate != _hz) {
-			fprintf(stderr, "Unsupported sample rate %d for WAV\n", channel->state.wav.sampleRate);
+		channel->type = type;
+		if (init_decoder(channel) < 0) {
+			uninit_channel(channel);
 			free_channel(channel);
-		} else {
-			channel->stereo = (channel->state.wav.channels == 2);
-			num = channel - _channels;
+			return -1;
+		}
+		if (!sound && key && _sound_max_length > 0) {
+			int frames_count = 0;
+			int16_t *samples = decode_sound(channel, &frames_count);
+			sound = add_sound(key, samples, frames_count, channel->stereo);
+			if (sound && sound->samples) {
+				uninit_channel(channel);
+			}
+		}
+	}
+	if (sound && sound->samples) {
+		/* mixed from the cached samples, without decoder or file */
+		channel->type = TYPE_PCM;
+		channel->stereo = sound->stereo;
+		channel->sound = sound;
+		channel->position = 0;
+		++sound->refs;
+		sound->last_used = ++_sound_counter;
+		if (play && play->loop) {
+			channel->loop = true;
+			channel->loop_end = (play->loop_end > 0) ? MIN(play->loop_end, sound->frames_count) : sound->frames_count;
+			channel->loop_start = (play->loop_start < channel->loop_end) ? MAX(play->loop_start, 0) : 0;
+		}
+	} else {
+		if (play && play->loop) {
+			/* the loop points are converted to the source rate, the streams are looped when decoded */
+			channel->loop = true;
+			channel->loop_start = (int64_t)MAX(play->loop_start, 0) * channel->hz / _hz;
+			channel->loop_end = (play->loop_end > 0) ? (int64_t)play->loop_end * channel->hz / _hz : 0;
+			if (channel->loop_end != 0 && channel->loop_end <= channel->loop_start) {
+				channel->loop_start = 0;
+			}
+			if (channel->type == TYPE_MP3 && channel->loop_start != 0 && key) {
+				if (!sound) {
+					sound = add_sound(key, 0, 0, channel->stereo);
+				}
+				if (sound) {
+					bind_seek_table(channel, sound);
+				}
+			}
 		}
+		/* the first samples are decoded here, the decoder thread keeps the ring filled afterwards */
+		atomic_store(&channel->ring_read, 0);
+		atomic_store(&channel->ring_write, 0);
+		atomic_store(&channel->ring_eos, false);
+		fill_ring(channel);
+	}
+	channel->start_time = play ? play->start : 0;
+	channel->after = (play && play->after >= 0 && play->after < MAX_CHANNELS) ? play->after : -1;
+	channel->after_generation = play ? play->after_generation : 0;
+	atomic_fetch_add_explicit(&channel->generation, 1, memory_order_relaxed);
+	/* the first frame is mixed with the gains of the sound, they are not ramped from the defaults */
+	channel->volume = play ? clamp_volume(play->volume) : 1.f;
+	channel->pan = play ? clamp_pan(play->pan) : 0.f;
+	atomic_store_explicit(&channel->frames_mixed, 0, memory_order_relaxed);
+	atomic_store_explicit(&channel->lipsync, false, memory_order_relaxed);
+	memset(&channel->voice, 0, sizeof(channel->voice));
+	for (int i = 0; i < VISEMES_HISTORY; ++i) {
+		atomic_store_explicit(&channel->visemes[i], VISEME_NONE, memory_order_relaxed);
+	}
+	atomic_store_explicit(&channel->status, CHANNEL_STARTING, memory_order_relaxed);
+	if (push_command(CMD_PLAY, channel) < 0) {
+		uninit_channel(channel);
+		free_channel(channel);
+		atomic_store_explicit(&channel->status, CHANNEL_FREE, memory_order_relaxed);
+		return -1;
+	}
+	if (channel->type != TYPE_PCM) {
+		pthread_mutex_lock(&_decode_lock);
+		channel->decoding = !atomic_load(&channel->ring_eos);
+		pthread_mutex_unlock(&_decode_lock);
 	}
-	_lock(0);
-	return num;
+	trim_sounds();
+	return channel - _channels;
 }
 
-int Mixer_Stop(int channel) {
-	_lock(1);
-	free_channel(&_channels[channel]);
-	_channels[channel].fp = 0;
-	_lock(0);
+int Mixer_PlayMp3(FILE *fp, const char *key, const struct mixer_play_t *play) {
+	return play_sound(fp, key, TYPE_MP3, play);
+}
+
+int Mixer_PlayWav(FILE *fp, const char *key, const struct mixer_play_t *play) {
+	return play_sound(fp, key, TYPE_WAV, play);
+}
+
+static bool is_active(struct mixer_channel_t *channel) {
+	const int status = atomic_load_explicit(&channel->status, memory_order_acquire);
+	return status == CHANNEL_STARTING || status == CHANNEL_PLAYING || status == CHANNEL_ENDED;
+}
+
+int Mixer_Stop(int num) {
+	struct mixer_channel_t *channel = &_channels[num];
+	if (!is_active(channel)) {
+		return 0;
+	}
+	/* the decoder thread no longer starts reading the stream once the flag is cleared, the caller owns the file again on return */
+	pthread_mutex_lock(&_decode_lock);
+	channel->decoding = false;
+	while (channel->filling) {
+		pthread_cond_wait(&_decode_cond, &_decode_lock);
+	}
+	pthread_mutex_unlock(&_decode_lock);
+	/* the callback releases the channel, unless it has already finished with it or there is no audio device */
+	if (atomic_exchange(&channel->status, CHANNEL_STOPPING) == CHANNEL_ENDED || !_output_opened) {
+		atomic_store(&channel->status, CHANNEL_RELEASED);
+	}
+	reclaim_channels();
+	return 0;
+}
+
+/* returns the bus frame being heard, from the time of the last callback and the device buffer size */
+static int64_t get_clock() {
+	int64_t time, frames;
+	uint32_t seq;
+	do {
+		seq = atomic_load_explicit(&_clock_seq, memory_order_acquire);
+		time = atomic_load_explicit(&_clock_time, memory_order_relaxed);
+		frames = atomic_load_explicit(&_clock_frames, memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) != 0 || seq != atomic_load_explicit(&_clock_seq, memory_order_relaxed));
+	/* the buffer written by the last callback is queued after the one the device is playing */
+	int64_t played = frames - _output_samples + (get_time_ns() - time) * _output_hz / 1000000000LL;
+	if (played > frames) {
+		played = frames;
+	}
+	return played * _hz / _output_hz - LIMITER_LOOKAHEAD;
+}
+
+/* returns the frames played at the mixer rate */
+int Mixer_GetPosition(int num) {
+	struct mixer_channel_t *channel = &_channels[num];
+	const int status = atomic_load_explicit(&channel->status, memory_order_acquire);
+	if (status != CHANNEL_PLAYING && status != CHANNEL_ENDED) {
+		return 0;
+	}
+	const int64_t position = get_clock() - atomic_load_explicit(&channel->start_frame, memory_order_relaxed);
+	if (position < 0) {
+		return 0;
+	}
+	return MIN(position, atomic_load_explicit(&channel->frames_mixed, memory_order_relaxed));
+}
+
+int Mixer_SetLipsync(int channel, int flag) {
+	if (!is_active(&_channels[channel])) {
+		return -1;
+	}
+	atomic_store_explicit(&_channels[channel].lipsync, flag != 0, memory_order_relaxed);
 	return 0;
 }
 
+/* the shape analyzed for the block being heard */
+int Mixer_GetViseme(int num) {
+	struct mixer_channel_t *channel = &_channels[num];
+	if (!atomic_load_explicit(&channel->lipsync, memory_order_relaxed)) {
+		return VISEME_NONE;
+	}
+	const int position = Mixer_GetPosition(num);
+	int64_t found = -1;
+	int viseme = VISEME_NONE;
+	for (int i = 0; i < VISEMES_HISTORY; ++i) {
+		const int64_t value = atomic_load_explicit(&channel->visemes[i], memory_order_relaxed);
+		const int64_t start = value >> 8;
+		if ((value & 255) != VISEME_NONE && start <= position && start > found) {
+			found = start;
+			viseme = value & 255;
+		}
+	}
+	return viseme;
+}
+
+int Mixer_GetRate() {
+	return _hz;
+}
+
+/* returns the first bus frame a sound can still be scheduled at, a callback in progress can mix up to another buffer (and the read ahead of the output resampler) */
+int64_t Mixer_GetTime() {
+	int64_t ahead = (int64_t)_output_samples * _hz / _output_hz + 1;
+	if (_output_hz != _hz) {
+		ahead += RESAMPLER_INPUT_FRAMES;
+	}
+	return atomic_load_explicit(&_clock_mixed, memory_order_relaxed) + ahead;
+}
+
+/* returns the delay in frames between a sound scheduled at Mixer_GetTime and the moment it is heard */
+int Mixer_GetLatency() {
+	const int64_t latency = Mixer_GetTime() - get_clock();
+	return (latency < 0) ? 0 : latency;
+}
+
+uint32_t Mixer_GetGeneration(int channel) {
+	return atomic_load_explicit(&_channels[channel].generation, memory_order_relaxed);
+}
+
 int Mixer_IsPlaying(int channel) {
-	_lock(1);
-	const int playing = _channels[channel].fp != 0;
-	_lock(0);
-	return playing;
+	const int status = atomic_load_explicit(&_channels[channel].status, memory_order_acquire);
+	return status == CHANNEL_STARTING || status == CHANNEL_PLAYING;
+}
+
+int Mixer_SetVolume(int channel, float volume) {
+	if (!is_active(&_channels[channel])) {
+		return -1;
+	}
+	_channels[channel].volume = clamp_volume(volume);
+	return push_command(CMD_SET_GAINS, &_channels[channel]);
+}
+
+int Mixer_SetPan(int channel, float pan) {
+	if (!is_active(&_channels[channel])) {
+		return -1;
+	}
+	_channels[channel].pan = clamp_pan(pan);
+	return push_command(CMD_SET_GAINS, &_channels[channel]);
 }
 
 static int16_t clipS16(int sample) {
 	return ((sample < SHRT_MIN) ? SHRT_MIN : ((sample > SHRT_MAX) ? SHRT_MAX : sample));
 }
 
-int Mixer_MixStereoS16(int16_t *samples, int len) {
-	memset(samples, 0, sizeof(int16_t) * 2 * len);
-	int16_t *buffer = alloca(sizeof(int16_t) * 2 * len);
-	for (int i = 0; i < MAX_CHANNELS; ++i) {
-		struct mixer_channel_t *channel = &_channels[i];
-		if (channel->fp) {
-			int count = 0;
-			switch (channel->type) {
-			case TYPE_MP3:
-				count = drmp3_read_pcm_frames_s16(&channel->state.mp3, len, buffer);
-				break;
-			case TYPE_WAV:
-				count = drwav_read_pcm_frames_s16(&channel->state.wav, len, buffer);
-				break;
+static int ramp_gain(int gain, int target) {
+	return (gain < target) ? MIN(gain + RAMP_STEP, target) : MAX(gain - RAMP_STEP, target);
+}
+
+/* the energy below 800 Hz, above 3 kHz and the zero crossings of the block select the shape of the mouth */
+static int classify_voice(struct mixer_voice_t *voice, float energy, float low, float high, int crossings, int count) {
+	const float rms = sqrtf(energy / count);
+	voice->envelope = fmaxf(rms, voice->envelope * (1.f - count / (VOICE_ENVELOPE_DECAY * _hz)));
+	const float level = rms / fmaxf(voice->envelope, 1e-6f);
+	const bool onset = energy > voice->energy * 8.f;
+	voice->energy = energy;
+	if (rms < 0.003f || level < 0.15f) {
+		return VISEME_M;
+	}
+	low /= energy;
+	high /= energy;
+	if (high > 0.2f && crossings > count * 3 / 10) {
+		return VISEME_F;
+	} else if (high > 0.12f) {
+		return VISEME_TH;
+	} else if (onset && level > 0.3f) {
+		return VISEME_D;
+	} else if (low > 0.85f) {
+		return (level > 0.5f) ? VISEME_OH : VISEME_U;
+	} else if (level > 0.6f) {
+		return VISEME_A;
+	} else if (low < 0.5f) {
+		return VISEME_EE;
+	}
+	return VISEME_UH;
+}
+
+static void analyze_voice(struct mixer_channel_t *channel, const int16_t *src, int count) {
+	struct mixer_voice_t *voice = &channel->voice;
+	const int step = channel->stereo ? 2 : 1;
+	float energy = 0.f, low = 0.f, high = 0.f;
+	int crossings = 0;
+	for (int i = 0; i < count; ++i) {
+		const float x = src[i * step] * (1.f / 32768);
+		voice->low += _voice_low_coef * (x - voice->low);
+		voice->high += _voice_high_coef * (x - voice->high);
+		const float h = x - voice->high;
+		energy += x * x;
+		low += voice->low * voice->low;
+		high += h * h;
+		crossings += (x < 0.f) != (voice->last < 0.f);
+		voice->last = x;
+	}
+	const int viseme = (energy > 0.f) ? classify_voice(voice, energy, low, high, crossings, count) : VISEME_M;
+	atomic_store_explicit(&channel->visemes[voice->count % VISEMES_HISTORY], ((int64_t)voice->frames << 8) | viseme, memory_order_relaxed);
+	voice->frames += count;
+	++voice->count;
+}
+
+/* mono samples are duplicated to both sides, the gains are updated every 4 frames */
+static void mix_channel(struct mixer_channel_t *channel, float *dst, const int16_t *src, int count) {
+	const int step = channel->stereo ? 2 : 1;
+	if (atomic_load_explicit(&channel->lipsync, memory_order_relaxed)) {
+		analyze_voice(channel, src, count);
+	}
+	int i = 0;
+#ifdef __SSE2__
+	for (; i + 4 <= count; i += 4) {
+		__m128i samples;
+		if (channel->stereo) {
+			samples = _mm_loadu_si128((const __m128i *)(src + i * 2));
+		} else {
+			samples = _mm_loadl_epi64((const __m128i *)(src + i));
+			samples = _mm_unpacklo_epi16(samples, samples);
+		}
+		const float l = channel->gain_l * (1.f / GAIN_ONE);
+		const float r = channel->gain_r * (1.f / GAIN_ONE);
+		const __m128 gains = _mm_set_ps(r, l, r, l);
+		const __m128 a = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16));
+		const __m128 b = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16));
+		_mm_storeu_ps(dst + i * 2,     _mm_add_ps(_mm_loadu_ps(dst + i * 2),     _mm_mul_ps(a, gains)));
+		_mm_storeu_ps(dst + i * 2 + 4, _mm_add_ps(_mm_loadu_ps(dst + i * 2 + 4), _mm_mul_ps(b, gains)));
+		channel->gain_l = ramp_gain(channel->gain_l, channel->target_l);
+		channel->gain_r = ramp_gain(channel->gain_r, channel->target_r);
+	}
+#endif
+	for (; i < count; ++i) {
+		const float l = channel->gain_l * (1.f / GAIN_ONE);
+		const float r = channel->gain_r * (1.f / GAIN_ONE);
+		dst[i * 2]     += src[i * step] * l;
+		dst[i * 2 + 1] += src[i * step + step - 1] * r;
+		if ((i & 3) == 3) {
+			channel->gain_l = ramp_gain(channel->gain_l, channel->target_l);
+			channel->gain_r = ramp_gain(channel->gain_r, channel->target_r);
+		}
+	}
+}
+
+/* returns the number of frames mixed, ended is set once the whole stream has been played */
+static int mix_ring(struct mixer_channel_t *channel, float *samples, int len, bool *ended) {
+	const int step = channel->stereo ? 2 : 1;
+	const bool eos = atomic_load_explicit(&channel->ring_eos, memory_order_acquire);
+	const uint32_t write = atomic_load_explicit(&channel->ring_write, memory_order_acquire);
+	uint32_t read = atomic_load_explicit(&channel->ring_read, memory_order_relaxed);
+	const int count = MIN(len, write - read);
+	for (int i = 0; i < count; ) {
+		const int offset = read & (RING_FRAMES - 1);
+		const int n = MIN(count - i, RING_FRAMES - offset);
+		mix_channel(channel, samples + i * 2, channel->ring + offset * step, n);
+		read += n;
+		i += n;
+	}
+	atomic_store_explicit(&channel->ring_read, read, memory_order_release);
+	if (count < len && !atomic_load_explicit(&channel->ring_eos, memory_order_relaxed)) {
+		atomic_fetch_add_explicit(&_stats_starved, 1, memory_order_relaxed);
+	}
+	*ended = eos && read == write;
+	return count;
+}
+
+static void process_commands() {
+	uint32_t read = atomic_load_explicit(&_commands_read, memory_order_relaxed);
+	const uint32_t write = atomic_load_explicit(&_commands_write, memory_order_acquire);
+	for (; read != write; ++read) {
+		const struct mixer_command_t *cmd = &_commands[read & (MAX_COMMANDS - 1)];
+		struct mixer_channel_t *channel = &_channels[cmd->channel];
+		switch (cmd->type) {
+		case CMD_PLAY: {
+				channel->gain_l = channel->target_l = cmd->gain_l;
+				channel->gain_r = channel->target_r = cmd->gain_r;
+				/* the start is known once the followed channel ends */
+				channel->follows = 0;
+				if (channel->after >= 0) {
+					struct mixer_channel_t *leader = &_channels[channel->after];
+					if (leader->listed && atomic_load_explicit(&leader->generation, memory_order_relaxed) == channel->after_generation) {
+						channel->follows = leader;
+					}
+				}
+				channel->started = false;
+				channel->mixed_block = -1;
+				const int64_t start = channel->follows ? INT64_MAX / 2 : channel->start_time;
+				atomic_store_explicit(&channel->start_frame, (start > _bus_frames) ? start : _bus_frames, memory_order_relaxed);
+				int status = CHANNEL_STARTING;
+				atomic_compare_exchange_strong(&channel->status, &status, CHANNEL_PLAYING);
+				add_playing_channel(channel);
 			}
-			if (count == 0) {
-				channel->fp = 0;
-				continue;
+			break;
+		case CMD_SET_GAINS:
+			channel->target_l = cmd->gain_l;
+			channel->target_r = cmd->gain_r;
+			if (!channel->started) {
+				/* nothing was heard yet, there is no change to ramp */
+				channel->gain_l = channel->target_l;
+				channel->gain_r = channel->target_r;
 			}
-			if (channel->stereo) {
-				for (int i = 0; i < count * 2; ++i) {
-					samples[i] = clipS16(samples[i] + buffer[i]);
-				}
-			} else {
-				for (int i = 0; i < count * 2; ++i) {
-					samples[i] = clipS16(samples[i] + buffer[i / 2]);
+			break;
+		}
+	}
+	atomic_store_explicit(&_commands_read, read, memory_order_release);
+}
+
+static void end_channel(struct mixer_channel_t *channel) {
+	remove_playing_channel(channel);
+	int status = CHANNEL_PLAYING;
+	if (!atomic_compare_exchange_strong(&channel->status, &status, CHANNEL_ENDED)) {
+		atomic_store(&channel->status, CHANNEL_RELEASED);
+	}
+}
+
+/* mixes the channel from the offset in the bus, returns the offset where the sound ended or -1 */
+static int mix_voice(struct mixer_channel_t *channel, int offset, int len) {
+	if (channel->type == TYPE_PCM) {
+		const struct mixer_sound_t *sound = channel->sound;
+		const int end = channel->loop ? channel->loop_end : sound->frames_count;
+		while (1) {
+			if (channel->position >= end) {
+				if (!channel->loop) {
+					return offset;
 				}
+				channel->position = channel->loop_start;
+			}
+			if (offset == len) {
+				break;
+			}
+			const int count = MIN(len - offset, end - channel->position);
+			mix_channel(channel, _bus + offset * 2, sound->samples + channel->position * (sound->stereo ? 2 : 1), count);
+			channel->position += count;
+			offset += count;
+			atomic_fetch_add_explicit(&channel->frames_mixed, count, memory_order_relaxed);
+		}
+		return -1;
+	}
+	bool ended;
+	const int count = mix_ring(channel, _bus + offset * 2, len - offset, &ended);
+	atomic_fetch_add_explicit(&channel->frames_mixed, count, memory_order_relaxed);
+	_refill = true;
+	return ended ? offset + count : -1;
+}
+
+/* the list is copied, the channels are removed while it is walked */
+static int get_playing_channels(struct mixer_channel_t **channels) {
+	int count = 0;
+	for (struct mixer_channel_t *channel = _playing_channels; channel; channel = channel->next) {
+		channels[count++] = channel;
+	}
+	return count;
+}
+
+static void start_followers(struct mixer_channel_t *channel, int offset, int len);
+
+static void play_channel(struct mixer_channel_t *channel, int offset, int len) {
+	if (!channel->started) {
+		channel->started = true;
+		atomic_store_explicit(&channel->start_frame, _bus_frames + offset, memory_order_relaxed);
+	}
+	channel->mixed_block = _bus_frames;
+	const int end = mix_voice(channel, offset, len);
+	if (end >= 0) {
+		end_channel(channel);
+		start_followers(channel, end, len);
+	}
+}
+
+/* the following sounds start in the same block, from the frame after the last one */
+static void start_followers(struct mixer_channel_t *channel, int offset, int len) {
+	struct mixer_channel_t *channels[MAX_CHANNELS];
+	const int count = get_playing_channels(channels);
+	for (int i = 0; i < count; ++i) {
+		struct mixer_channel_t *follower = channels[i];
+		if (follower->follows == channel) {
+			follower->follows = 0;
+			if (follower->listed && atomic_load_explicit(&follower->status, memory_order_relaxed) != CHANNEL_STOPPING) {
+				play_channel(follower, offset, len);
+			}
+		}
+	}
+}
+
+static void mix_bus(int len) {
+	memset(_bus, 0, sizeof(float) * 2 * len);
+	_refill = false;
+	struct mixer_channel_t *channels[MAX_CHANNELS];
+	const int count = get_playing_channels(channels);
+	for (int i = 0; i < count; ++i) {
+		struct mixer_channel_t *channel = channels[i];
+		if (!channel->listed || channel->mixed_block == _bus_frames) {
+			/* ended, or started by the channel it follows */
+			continue;
+		}
+		if (atomic_load_explicit(&channel->status, memory_order_relaxed) == CHANNEL_STOPPING) {
+			remove_playing_channel(channel);
+			start_followers(channel, 0, len);
+			atomic_store_explicit(&channel->status, CHANNEL_RELEASED, memory_order_release);
+			continue;
+		}
+		if (channel->follows) {
+			continue;
+		}
+		int offset = 0;
+		if (!channel->started && channel->start_time > _bus_frames) {
+			if (channel->start_time >= _bus_frames + len) {
+				continue;
 			}
+			offset = channel->start_time - _bus_frames;
 		}
+		play_channel(channel, offset, len);
+	}
+	if (_refill) {
+		sem_post(&_decode_sem);
 	}
+}
+
+/* the frames are delayed by the look-ahead, the gain reaches the level required by each frame before it is output */
+static void limit_bus(int16_t *samples, int len) {
+	for (int i = 0; i < len; ++i) {
+		const float l = _bus[i * 2];
+		const float r = _bus[i * 2 + 1];
+		const float peak = fmaxf(fabsf(l), fabsf(r));
+		const int pos = _limiter_pos;
+		const float out_l = _limiter_frames[pos * 2];
+		const float out_r = _limiter_frames[pos * 2 + 1];
+		_limiter_gain = fminf(_limiter_gain, _limiter_levels[pos]);
+		samples[i * 2]     = clipS16(lrintf(out_l * _limiter_gain));
+		samples[i * 2 + 1] = clipS16(lrintf(out_r * _limiter_gain));
+		_limiter_frames[pos * 2] = l;
+		_limiter_frames[pos * 2 + 1] = r;
+		_limiter_levels[pos] = (peak > LIMITER_THRESHOLD) ? LIMITER_THRESHOLD / peak : 1.f;
+		_limiter_pos = (pos + 1) & (LIMITER_LOOKAHEAD - 1);
+		float slope = 0.f;
+		float level = 1.f;
+		for (int j = 1; j <= LIMITER_LOOKAHEAD; ++j) {
+			const float next = _limiter_levels[(pos + j) & (LIMITER_LOOKAHEAD - 1)];
+			slope = fmaxf(slope, (_limiter_gain - next) / j);
+			level = fminf(level, next);
+		}
+		if (slope > 0.f) {
+			_limiter_gain -= slope;
+		} else {
+			_limiter_gain = fminf(_limiter_gain + (1.f - _limiter_gain) * _limiter_release, level);
+		}
+	}
+}
+
+static int mix_frames(void *param, int16_t *samples, int len) {
+	process_commands();
+	for (int i = 0; i < len; i += MIX_FRAMES) {
+		const int count = MIN(len - i, MIX_FRAMES);
+		mix_bus(count);
+		limit_bus(samples + i * 2, count);
+		_bus_frames += count;
+	}
+	return len;
+}
+
+static void update_max(atomic_llong *max, int64_t value) {
+	if (value > atomic_load_explicit(max, memory_order_relaxed)) {
+		atomic_store_explicit(max, value, memory_order_relaxed);
+	}
+}
+
+int Mixer_MixStereoS16(int16_t *samples, int len) {
+	const int64_t start = get_time_ns();
+	if (_callback_time != 0) {
+		const int64_t interval = start - _callback_time;
+		atomic_fetch_add_explicit(&_stats_interval_sum, interval, memory_order_relaxed);
+		update_max(&_stats_interval_max, interval);
+		/* the device played the previous buffer before being given the next one */
+		const int64_t period = len * 1000000000LL / _output_hz;
+		if (interval > period + period / 2) {
+			atomic_fetch_add_explicit(&_stats_underruns, 1, memory_order_relaxed);
+		}
+	}
+	_callback_time = start;
+	atomic_fetch_add_explicit(&_clock_seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&_clock_time, start, memory_order_relaxed);
+	atomic_store_explicit(&_clock_frames, _device_frames, memory_order_relaxed);
+	atomic_fetch_add_explicit(&_clock_seq, 1, memory_order_release);
+	_device_frames += len;
+	if (_output_hz != _hz) {
+		/* the bus is mixed at the engine rate and converted once to the device rate */
+		Resampler_Read(&_output_resampler, samples, len, mix_frames, 0);
+	} else {
+		mix_frames(0, samples, len);
+	}
+	atomic_store_explicit(&_clock_mixed, _bus_frames, memory_order_relaxed);
+	const int64_t duration = get_time_ns() - start;
+	atomic_fetch_add_explicit(&_stats_duration_sum, duration, memory_order_relaxed);
+	update_max(&_stats_duration_max, duration);
+	atomic_fetch_add_explicit(&_stats_callbacks, 1, memory_order_release);
 	return 0;
 }
+
+void Mixer_GetStats(struct mixer_stats_t *stats) {
+	const int callbacks = atomic_load_explicit(&_stats_callbacks, memory_order_acquire);
+	stats->callbacks = callbacks;
+	stats->interval_avg = (callbacks > 1) ? atomic_load(&_stats_interval_sum) / (callbacks - 1) / 1000 : 0;
+	stats->interval_max = atomic_load(&_stats_interval_max) / 1000;
+	stats->duration_avg = (callbacks > 0) ? atomic_load(&_stats_duration_sum) / callbacks / 1000 : 0;
+	stats->duration_max = atomic_load(&_stats_duration_max) / 1000;
+	stats->underruns = atomic_load(&_stats_underruns);
+	stats->starved = atomic_load(&_stats_starved);
+}
@@ -4,17 +4,58 @@
 
 #include "intern.h"
 
-typedef void (*MixerLockProc)(int);
+enum {
+	VISEME_NONE = 0,
+	VISEME_A,
+	VISEME_EE,
+	VISEME_OH,
+	VISEME_U,
+	VISEME_D,
+	VISEME_M, /* closed, silence */
+	VISEME_TH,
+	VISEME_F,
+	VISEME_UH
+};
 
-int Mixer_Init(int hz, MixerLockProc lockProc);
+struct mixer_stats_t {
+	int callbacks;
+	int interval_avg, interval_max; /* microseconds */
+	int duration_avg, duration_max;
+	int underruns; /* callbacks later than one and a half buffer */
+	int starved; /* streams not decoded in time */
+};
+
+/* times in frames at the mixer rate, a sound without schedule starts with the next buffer */
+struct mixer_play_t {
+	int64_t start; /* mixer time, 0 to start immediately */
+	int after; /* channel to follow without gap, -1 for none */
+	uint32_t after_generation; /* of the play to follow, as returned by Mixer_GetGeneration */
+	int loop;
+	int loop_start, loop_end; /* loop_end 0 for the end of the sound */
+	float volume, pan; /* applied from the first frame */
+};
+
+int Mixer_Init(int hz);
 int Mixer_Fini();
+void Mixer_SetOutput(int hz, int samples);
 
-int Mixer_PlayMp3(FILE *fp);
-int Mixer_PlayWav(FILE *fp);
+int Mixer_PlayMp3(FILE *fp, const char *key, const struct mixer_play_t *play);
+int Mixer_PlayWav(FILE *fp, const char *key, const struct mixer_play_t *play);
 int Mixer_Stop(int channel);
 int Mixer_IsPlaying(int channel);
+uint32_t Mixer_GetGeneration(int channel);
+int Mixer_GetPosition(int channel);
+int Mixer_GetRate();
+int64_t Mixer_GetTime();
+int Mixer_GetLatency();
+int Mixer_SetLipsync(int channel, int flag);
+int Mixer_GetViseme(int channel);
 int Mixer_SetVolume(int channel, float volume);
 int Mixer_SetPan(int channel, float pan);
+void Mixer_SetSoundCache(int size, int max_length);
+void Mixer_TrimCache();
+int Mixer_SetResamplerQuality(int quality);
 int Mixer_MixStereoS16(int16_t *samples, int len);
+void Mixer_GetStats(struct mixer_stats_t *stats);
 
 #endif
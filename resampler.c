@@ -0,0 +1,241 @@
+
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "memory.h"
+#include "resampler.h"
+
+#define PHASE_BITS 8
+#define PHASES     (1 << PHASE_BITS)
+
+#define COEF_BITS  14
+
+/* the downsampling cutoffs are rounded down, the rates of the sounds then share a few tables */
+#define CUTOFF_STEP 10
+
+struct resampler_table_t {
+	int taps;
+	int cutoff; /* per mille of the input rate */
+	int16_t *coeffs;
+};
+
+static struct resampler_table_t *_tables;
+static int _tables_count;
+
+static double bessel_i0(double x) {
+	double sum = 1., term = 1.;
+	for (int k = 1; k < 32; ++k) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+		if (term < sum * 1e-12) {
+			break;
+		}
+	}
+	return sum;
+}
+
+static void build_sinc(int16_t *coeffs, int taps, double cutoff, double beta) {
+	double h[RESAMPLER_MAX_TAPS];
+	for (int phase = 0; phase < PHASES; ++phase) {
+		const double frac = phase / (double)PHASES;
+		double sum = 0.;
+		for (int i = 0; i < taps; ++i) {
+			const double x = i - (taps / 2 - 1) - frac;
+			const double t = x / (taps / 2);
+			if (t <= -1. || t >= 1.) {
+				h[i] = 0.;
+				continue;
+			}
+			const double w = bessel_i0(beta * sqrt(1. - t * t)) / bessel_i0(beta);
+			const double s = (x == 0.) ? 1. : sin(M_PI * 2 * cutoff * x) / (M_PI * 2 * cutoff * x);
+			h[i] = s * w;
+			sum += h[i];
+		}
+		/* each phase has unity gain at DC */
+		for (int i = 0; i < taps; ++i) {
+			coeffs[phase * taps + i] = (int16_t)lrint(h[i] / sum * (1 << COEF_BITS));
+		}
+	}
+}
+
+static void build_linear(int16_t *coeffs) {
+	for (int phase = 0; phase < PHASES; ++phase) {
+		const int f = (phase << COEF_BITS) >> PHASE_BITS;
+		coeffs[phase * 2] = (1 << COEF_BITS) - f;
+		coeffs[phase * 2 + 1] = f;
+	}
+}
+
+static const int16_t *get_table(int taps, int cutoff) {
+	for (int i = 0; i < _tables_count; ++i) {
+		if (_tables[i].taps == taps && _tables[i].cutoff == cutoff) {
+			return _tables[i].coeffs;
+		}
+	}
+	struct resampler_table_t *tables = (struct resampler_table_t *)realloc(_tables, (_tables_count + 1) * sizeof(struct resampler_table_t));
+	if (!tables) {
+		return 0;
+	}
+	_tables = tables;
+	int16_t *coeffs = (int16_t *)Memory_Alloc(MEMORY_AUDIO, PHASES * taps * sizeof(int16_t));
+	if (!coeffs) {
+		return 0;
+	}
+	if (taps == 2) {
+		build_linear(coeffs);
+	} else {
+		build_sinc(coeffs, taps, cutoff / 1000., (taps > 8) ? 8. : 5.);
+	}
+	struct resampler_table_t *table = &_tables[_tables_count++];
+	table->taps = taps;
+	table->cutoff = cutoff;
+	table->coeffs = coeffs;
+	return coeffs;
+}
+
+void Resampler_FreeTables() {
+	for (int i = 0; i < _tables_count; ++i) {
+		Memory_Free(MEMORY_AUDIO, _tables[i].coeffs);
+	}
+	free(_tables);
+	_tables = 0;
+	_tables_count = 0;
+}
+
+int Resampler_IsValidQuality(int quality) {
+	return quality >= RESAMPLER_LINEAR && quality <= RESAMPLER_SINC_LONG;
+}
+
+int Resampler_Init(struct resampler_t *r, int quality, int channels, int in_hz, int out_hz) {
+	assert(channels == 1 || channels == 2);
+	int taps, cutoff = 0;
+	switch (quality) {
+	case RESAMPLER_LINEAR:
+		taps = 2;
+		break;
+	case RESAMPLER_SINC_SHORT:
+		taps = 8;
+		break;
+	case RESAMPLER_SINC_LONG:
+		taps = 32;
+		break;
+	default:
+		fprintf(stderr, "Unsupported resampler quality %d\n", quality);
+		return 0;
+	}
+	if (taps != 2) {
+		/* the passband is reduced below the output Nyquist when downsampling */
+		cutoff = 450;
+		if (out_hz < in_hz) {
+			cutoff = (int)(450LL * out_hz / in_hz) / CUTOFF_STEP * CUTOFF_STEP;
+		}
+	}
+	r->coeffs = get_table(taps, cutoff);
+	if (!r->coeffs) {
+		fprintf(stderr, "Failed to allocate resampler table taps %d cutoff %d\n", taps, cutoff);
+		return 0;
+	}
+	r->channels = channels;
+	r->taps = taps;
+	r->step = ((uint64_t)in_hz << 32) / out_hz;
+	Resampler_Reset(r);
+	return 1;
+}
+
+void Resampler_Reset(struct resampler_t *r) {
+	/* the first output frame is centered on the first input frame */
+	r->count = r->taps / 2 - 1;
+	for (int c = 0; c < r->channels; ++c) {
+		memset(r->input[c], 0, r->count * sizeof(int16_t));
+	}
+	r->pos = 0;
+	r->flushed = false;
+}
+
+static int fill_input(struct resampler_t *r, ResamplerReadProc proc, void *param) {
+	/* the position can be past the end of the buffer when downsampling */
+	const int consumed = MIN(r->pos >> 32, r->count);
+	if (consumed != 0) {
+		r->count -= consumed;
+		for (int c = 0; c < r->channels; ++c) {
+			memmove(r->input[c], r->input[c] + consumed, r->count * sizeof(int16_t));
+		}
+		r->pos -= (uint64_t)consumed << 32;
+	}
+	/* less than taps frames are left, there is room for a full read */
+	int count = proc(param, r->buffer, RESAMPLER_INPUT_FRAMES);
+	if (count > 0) {
+		if (r->channels == 2) {
+			for (int i = 0; i < count; ++i) {
+				r->input[0][r->count + i] = r->buffer[2 * i];
+				r->input[1][r->count + i] = r->buffer[2 * i + 1];
+			}
+		} else {
+			memcpy(r->input[0] + r->count, r->buffer, count * sizeof(int16_t));
+		}
+	} else {
+		if (r->flushed) {
+			return 0;
+		}
+		/* pad with silence to output the tail of the filter */
+		count = r->taps / 2;
+		for (int c = 0; c < r->channels; ++c) {
+			memset(r->input[c] + r->count, 0, count * sizeof(int16_t));
+		}
+		r->flushed = true;
+	}
+	r->count += count;
+	return count;
+}
+
+static int16_t filter(const int16_t *src, const int16_t *coeffs, int taps) {
+	int acc;
+#ifdef __SSE2__
+	if ((taps & 7) == 0) {
+		__m128i sum = _mm_setzero_si128();
+		for (int i = 0; i < taps; i += 8) {
+			const __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+			const __m128i c = _mm_loadu_si128((const __m128i *)(coeffs + i));
+			sum = _mm_add_epi32(sum, _mm_madd_epi16(s, c));
+		}
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+		acc = _mm_cvtsi128_si32(sum);
+	} else
+#endif
+	{
+		acc = 0;
+		for (int i = 0; i < taps; ++i) {
+			acc += src[i] * coeffs[i];
+		}
+	}
+	acc = (acc + (1 << (COEF_BITS - 1))) >> COEF_BITS;
+	if (acc < -32768) {
+		return -32768;
+	} else if (acc > 32767) {
+		return 32767;
+	}
+	return acc;
+}
+
+int Resampler_Read(struct resampler_t *r, int16_t *out, int count, ResamplerReadProc proc, void *param) {
+	int produced = 0;
+	while (produced < count) {
+		const int index = r->pos >> 32;
+		if (index + r->taps > r->count) {
+			if (fill_input(r, proc, param) == 0) {
+				break;
+			}
+			continue;
+		}
+		const int phase = (r->pos >> (32 - PHASE_BITS)) & (PHASES - 1);
+		const int16_t *coeffs = r->coeffs + phase * r->taps;
+		for (int c = 0; c < r->channels; ++c) {
+			*out++ = filter(r->input[c] + index, coeffs, r->taps);
+		}
+		r->pos += r->step;
+		++produced;
+	}
+	return produced;
+}
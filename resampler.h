@@ -0,0 +1,39 @@
+
+#ifndef RESAMPLER_H__
+#define RESAMPLER_H__
+
+#include "intern.h"
+
+enum {
+	RESAMPLER_LINEAR = 0,
+	RESAMPLER_SINC_SHORT, /* 8 taps */
+	RESAMPLER_SINC_LONG   /* 32 taps */
+};
+
+#define RESAMPLER_MAX_TAPS     32
+#define RESAMPLER_INPUT_FRAMES 512
+
+typedef int (*ResamplerReadProc)(void *param, int16_t *buffer, int count);
+
+struct resampler_t {
+	int channels;
+	int taps;
+	const int16_t *coeffs; /* taps per phase */
+	uint64_t pos; /* 32.32 fixed point, in input frames */
+	uint64_t step;
+	int count;
+	bool flushed;
+	int16_t input[2][RESAMPLER_INPUT_FRAMES + RESAMPLER_MAX_TAPS];
+	int16_t buffer[RESAMPLER_INPUT_FRAMES * 2];
+};
+
+/* the filters tables are shared, the resamplers must be initialized from the same thread */
+
+void Resampler_FreeTables();
+
+int Resampler_IsValidQuality(int quality);
+int Resampler_Init(struct resampler_t *r, int quality, int channels, int in_hz, int out_hz);
+void Resampler_Reset(struct resampler_t *r);
+int Resampler_Read(struct resampler_t *r, int16_t *out, int count, ResamplerReadProc proc, void *param);
+
+#endif // RESAMPLER_H__
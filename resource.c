@@ -1,19 +1,173 @@
 
+#include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
 #include "animation.h"
+#include "bakefile.h"
 #include "resource.h"
+#include "trace.h"
 #include "zipfile.h"
 
 static const char *_data_path;
+static int _loading_mode = ANIM_LOAD_BLOCKING;
 
-static char **_filenames;
-static int _filenames_count;
+/* the index and the archives are shared with the preload thread */
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void start_preload();
+static void stop_preload();
+static void dump_open_stats();
+
+/* paths are indexed lowercase with '/' separators */
+
+struct index_entry_t {
+	uint32_t hash;
+	char *key;
+	char *path; /* loose file relative to the data path */
+	struct zipfile_t *zf;
+	struct zipentry_t *ze;
+	struct index_entry_t *next;
+};
+
+#define MIN_INDEX_BUCKETS 1024
+
+static struct index_entry_t **_index;
+static int _index_buckets_count;
+static int _index_count;
+static int _files_count;
+
+#define NEGATIVE_CACHE_SIZE 256
+
+static struct {
+	uint32_t hash;
+	char *key;
+} _negative_cache[NEGATIVE_CACHE_SIZE];
+
+static void make_key(const char *name, char *buf) {
+	for (; *name; ++name) {
+		*buf++ = tolower((uint8_t)*name);
+	}
+	*buf = 0;
+}
+
+static void grow_index() {
+	const int count = _index_buckets_count ? _index_buckets_count * 2 : MIN_INDEX_BUCKETS;
+	struct index_entry_t **buckets = (struct index_entry_t **)calloc(count, sizeof(struct index_entry_t *));
+	if (!buckets) {
+		return;
+	}
+	for (int i = 0; i < _index_buckets_count; ++i) {
+		for (struct index_entry_t *entry = _index[i]; entry; ) {
+			struct index_entry_t *next = entry->next;
+			struct index_entry_t **bucket = &buckets[entry->hash & (count - 1)];
+			entry->next = *bucket;
+			*bucket = entry;
+			entry = next;
+		}
+	}
+	free(_index);
+	_index = buckets;
+	_index_buckets_count = count;
+}
+
+static struct index_entry_t *find_index_entry(const char *key, uint32_t hash) {
+	if (_index_buckets_count == 0) {
+		return 0;
+	}
+	for (struct index_entry_t *entry = _index[hash & (_index_buckets_count - 1)]; entry; entry = entry->next) {
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+	}
+	return 0;
+}
+
+static struct index_entry_t *add_index_entry(const char *name) {
+	char key[MAXPATHLEN];
+	make_key(name, key);
+	const uint32_t hash = hash_key(key);
+	struct index_entry_t *entry = find_index_entry(key, hash);
+	if (entry) {
+		return entry;
+	}
+	if (_index_count >= _index_buckets_count) {
+		grow_index();
+	}
+	entry = (struct index_entry_t *)calloc(1, sizeof(struct index_entry_t));
+	if (entry) {
+		entry->hash = hash;
+		entry->key = strdup(key);
+		struct index_entry_t **bucket = &_index[hash & (_index_buckets_count - 1)];
+		entry->next = *bucket;
+		*bucket = entry;
+		++_index_count;
+	}
+	return entry;
+}
+
+static void free_index() {
+	for (int i = 0; i < _index_buckets_count; ++i) {
+		for (struct index_entry_t *entry = _index[i]; entry; ) {
+			struct index_entry_t *next = entry->next;
+			free(entry->key);
+			free(entry->path);
+			free(entry);
+			entry = next;
+		}
+	}
+	free(_index);
+	_index = 0;
+	_index_buckets_count = 0;
+	_index_count = 0;
+	for (int i = 0; i < NEGATIVE_CACHE_SIZE; ++i) {
+		free(_negative_cache[i].key);
+		_negative_cache[i].key = 0;
+	}
+}
+
+static bool is_negative_cached(const char *key, uint32_t hash) {
+	const int i = hash & (NEGATIVE_CACHE_SIZE - 1);
+	return _negative_cache[i].key && _negative_cache[i].hash == hash && strcmp(_negative_cache[i].key, key) == 0;
+}
+
+static void add_negative_cache(const char *key, uint32_t hash) {
+	const int i = hash & (NEGATIVE_CACHE_SIZE - 1);
+	free(_negative_cache[i].key);
+	_negative_cache[i].hash = hash;
+	_negative_cache[i].key = strdup(key);
+}
+
+/* the directories scanned, to check the validity of the index cache */
+
+static struct {
+	char *path; /* relative to the data path */
+	uint64_t mtime;
+} *_dirs;
+static int _dirs_count;
+
+static void add_dir(const char *dirname, int dirname_offset) {
+	struct stat st;
+	if (stat(dirname, &st) == 0) {
+		void *dirs = realloc(_dirs, (_dirs_count + 1) * sizeof(*_dirs));
+		if (dirs) {
+			_dirs = dirs;
+			_dirs[_dirs_count].path = strdup(dirname + MIN(dirname_offset, strlen(dirname)));
+			_dirs[_dirs_count].mtime = get_mtime(&st);
+			++_dirs_count;
+		}
+	}
+}
 
 static void list_filenames(const char *dirname, int dirname_offset) {
 	DIR *d = opendir(dirname);
 	if (d) {
+		add_dir(dirname, dirname_offset);
 		struct dirent *de;
 		while ((de = readdir(d)) != NULL) {
 			if (de->d_name[0] == '.') {
@@ -26,10 +180,10 @@ static void list_filenames(const char *dirname, int dirname_offset) {
 				if (S_ISDIR(st.st_mode)) {
 					list_filenames(path, dirname_offset);
 				} else {
-					_filenames = (char **)realloc(_filenames, (_filenames_count + 1) * sizeof(char *));
-					if (_filenames) {
-						_filenames[_filenames_count] = strdup(path + dirname_offset);
-						++_filenames_count;
+					struct index_entry_t *entry = add_index_entry(path + dirname_offset);
+					if (entry && !entry->path) {
+						entry->path = strdup(path + dirname_offset);
+						++_files_count;
 					}
 				}
 			}
@@ -44,13 +198,71 @@ static const char *DIRS[] = { "interface", "movies", 0 };
 
 static struct {
 	char *name;
+	char *path;
+	uint64_t size;
+	uint64_t mtime;
+	bool opened;
 	struct zipfile_t *zf;
+	struct bakefile_t *bf;
 } _zipfiles[MAX_ZIPFILES];
+static int _zipfiles_count;
+
+static void add_zipfile(const char *name, const struct stat *st) {
+	char hepath[MAXPATHLEN];
+	snprintf(hepath, sizeof(hepath), "%s/%s", _data_path, name);
+	assert(_zipfiles_count < MAX_ZIPFILES);
+	_zipfiles[_zipfiles_count].name = strdup(name);
+	_zipfiles[_zipfiles_count].path = strdup(hepath);
+	_zipfiles[_zipfiles_count].size = st->st_size;
+	_zipfiles[_zipfiles_count].mtime = get_mtime(st);
+	_zipfiles[_zipfiles_count].bf = Bakefile_Open(hepath);
+	++_zipfiles_count;
+}
+
+/* archives are opened and indexed on the first lookup */
+static struct zipfile_t *get_zipfile(int num) {
+	if (!_zipfiles[num].opened) {
+		struct zipfile_t *zf = Zipfile_Open(_zipfiles[num].path);
+		_zipfiles[num].zf = zf;
+		_zipfiles[num].opened = true;
+		if (zf) {
+			const char *ext = strrchr(_zipfiles[num].name, '.');
+			const int len = ext ? ext - _zipfiles[num].name : strlen(_zipfiles[num].name);
+			for (int i = 0; i < Zipfile_GetEntriesCount(zf); ++i) {
+				struct zipentry_t *ze = Zipfile_GetEntry(zf, i);
+				if (Zipfile_GetEntrySize(zf, ze) != 0) {
+					char name[MAXPATHLEN];
+					snprintf(name, sizeof(name), "%.*s/%s", len, _zipfiles[num].name, Zipfile_GetEntryName(zf, ze));
+					struct index_entry_t *entry = add_index_entry(name);
+					if (entry && !entry->ze) {
+						entry->zf = zf;
+						entry->ze = ze;
+					}
+				}
+			}
+		}
+	}
+	return _zipfiles[num].zf;
+}
+
+static int find_zipfile(const char *name) {
+	const char *sep = strchr(name, '/');
+	if (sep) {
+		for (int i = 0; i < MAX_ZIPFILES && _zipfiles[i].name; ++i) {
+			const char *ext = strrchr(_zipfiles[i].name, '.');
+			const int len = ext ? ext - _zipfiles[i].name : strlen(_zipfiles[i].name);
+			if (len == sep - name && strncasecmp(_zipfiles[i].name, name, len) == 0) {
+				return i;
+			}
+		}
+	}
+	return -1;
+}
 
 static void list_datafiles(const char *path) {
 	DIR *d = opendir(path);
 	if (d) {
-		int count = 0;
+		add_dir(path, strlen(path) + 1);
 		struct dirent *de;
 		while ((de = readdir(d)) != NULL) {
 			if (de->d_name[0] == '.') {
@@ -60,12 +272,9 @@ static void list_datafiles(const char *path) {
 			if (ext && strcasecmp(ext + 1, "he") == 0) {
 				char hepath[MAXPATHLEN];
 				snprintf(hepath, sizeof(hepath), "%s/%s", path, de->d_name);
-				struct zipfile_t *zf = Zipfile_Open(hepath);
-				if (zf) {
-					assert(count < MAX_ZIPFILES);
-					_zipfiles[count].name = strdup(de->d_name);
-					_zipfiles[count].zf = zf;
-					++count;
+				struct stat st;
+				if (stat(hepath, &st) == 0) {
+					add_zipfile(de->d_name, &st);
 				}
 				continue;
 			}
@@ -82,15 +291,204 @@ static void list_datafiles(const char *path) {
 			}
 		}
 		closedir(d);
-		fprintf(stdout, "Found %d files\n", _filenames_count);
-		fprintf(stdout, "Found %d zipfiles\n", count);
 	}
 }
 
+/* the result of the data files scan is cached between runs */
+
+#define INDEX_TAG     0x58444959 /* 'YIDX' */
+#define INDEX_VERSION 1
+
+/* the index is kept out of the data directory, writing it there would change the modification time it records */
+static int get_index_path(char *buf, int size) {
+	const char *path = getenv("INDEXPATH");
+	if (path) {
+		snprintf(buf, size, "%s", path);
+		return 1;
+	}
+	char dir[MAXPATHLEN];
+	const char *cache = getenv("XDG_CACHE_HOME");
+	if (cache && cache[0]) {
+		snprintf(dir, sizeof(dir), "%s", cache);
+	} else {
+		const char *home = getenv("HOME");
+		if (!home || !home[0]) {
+			return 0;
+		}
+		snprintf(dir, sizeof(dir), "%s/.cache", home);
+	}
+	mkdir(dir, 0755);
+	strncat(dir, "/yagaboot", sizeof(dir) - strlen(dir) - 1);
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		return 0;
+	}
+	/* one index per data directory */
+	char data_path[PATH_MAX];
+	if (!realpath(_data_path, data_path)) {
+		snprintf(data_path, sizeof(data_path), "%s", _data_path);
+	}
+	return snprintf(buf, size, "%s/%08x.idx", dir, hash_key(data_path)) < size;
+}
+
+static void write_string(FILE *fp, const char *s) {
+	const uint16_t len = strlen(s);
+	fwrite(&len, sizeof(len), 1, fp);
+	fwrite(s, 1, len, fp);
+}
+
+static const char *read_string(const uint8_t **p, const uint8_t *end, char *buf) {
+	if (*p + sizeof(uint16_t) > end) {
+		return 0;
+	}
+	uint16_t len;
+	memcpy(&len, *p, sizeof(len));
+	*p += sizeof(len);
+	if (len >= MAXPATHLEN || *p + len > end) {
+		return 0;
+	}
+	memcpy(buf, *p, len);
+	buf[len] = 0;
+	*p += len;
+	return buf;
+}
+
+static int read_u64(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+	if (*p + sizeof(uint64_t) > end) {
+		return 0;
+	}
+	memcpy(value, *p, sizeof(uint64_t));
+	*p += sizeof(uint64_t);
+	return 1;
+}
+
+static void save_index() {
+	char path[MAXPATHLEN];
+	if (!get_index_path(path, sizeof(path))) {
+		return;
+	}
+	char tmp_path[MAXPATHLEN + 4];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	FILE *fp = fopen(tmp_path, "wb");
+	if (!fp) {
+		fprintf(stderr, "Failed to open '%s'\n", tmp_path);
+		return;
+	}
+	const uint64_t hdr[] = { INDEX_TAG, INDEX_VERSION, _dirs_count, _zipfiles_count, _files_count };
+	fwrite(hdr, sizeof(hdr), 1, fp);
+	write_string(fp, _data_path);
+	for (int i = 0; i < _dirs_count; ++i) {
+		fwrite(&_dirs[i].mtime, sizeof(uint64_t), 1, fp);
+		write_string(fp, _dirs[i].path);
+	}
+	for (int i = 0; i < _zipfiles_count; ++i) {
+		fwrite(&_zipfiles[i].size, sizeof(uint64_t), 1, fp);
+		fwrite(&_zipfiles[i].mtime, sizeof(uint64_t), 1, fp);
+		write_string(fp, _zipfiles[i].name);
+	}
+	for (int i = 0; i < _index_buckets_count; ++i) {
+		for (struct index_entry_t *entry = _index[i]; entry; entry = entry->next) {
+			if (entry->path) {
+				write_string(fp, entry->path);
+			}
+		}
+	}
+	const int err = ferror(fp);
+	fclose(fp);
+	if (err || rename(tmp_path, path) != 0) {
+		fprintf(stderr, "Failed to write '%s'\n", path);
+		unlink(tmp_path);
+	}
+}
+
+static int parse_index(const uint8_t *p, const uint8_t *end) {
+	uint64_t hdr[5];
+	if (p + sizeof(hdr) > end) {
+		return 0;
+	}
+	memcpy(hdr, p, sizeof(hdr));
+	p += sizeof(hdr);
+	if (hdr[0] != INDEX_TAG || hdr[1] != INDEX_VERSION || hdr[3] > MAX_ZIPFILES) {
+		return 0;
+	}
+	char buf[MAXPATHLEN];
+	if (!read_string(&p, end, buf) || strcmp(buf, _data_path) != 0) {
+		return 0;
+	}
+	/* any file added or removed changes the modification time of its directory */
+	for (int i = 0; i < hdr[2]; ++i) {
+		uint64_t mtime;
+		if (!read_u64(&p, end, &mtime) || !read_string(&p, end, buf)) {
+			return 0;
+		}
+		char path[MAXPATHLEN * 2];
+		snprintf(path, sizeof(path), "%s/%s", _data_path, buf);
+		struct stat st;
+		if (stat(path, &st) != 0 || get_mtime(&st) != mtime) {
+			return 0;
+		}
+	}
+	const uint8_t *zipfiles = p;
+	for (int i = 0; i < hdr[3]; ++i) {
+		uint64_t size, mtime;
+		if (!read_u64(&p, end, &size) || !read_u64(&p, end, &mtime) || !read_string(&p, end, buf)) {
+			return 0;
+		}
+		char path[MAXPATHLEN * 2];
+		snprintf(path, sizeof(path), "%s/%s", _data_path, buf);
+		struct stat st;
+		if (stat(path, &st) != 0 || st.st_size != size || get_mtime(&st) != mtime) {
+			return 0;
+		}
+	}
+	/* the cache is valid */
+	p = zipfiles;
+	for (int i = 0; i < hdr[3]; ++i) {
+		p += 2 * sizeof(uint64_t);
+		read_string(&p, end, buf);
+		char path[MAXPATHLEN * 2];
+		snprintf(path, sizeof(path), "%s/%s", _data_path, buf);
+		struct stat st;
+		if (stat(path, &st) == 0) {
+			add_zipfile(buf, &st);
+		}
+	}
+	for (int i = 0; i < hdr[4] && read_string(&p, end, buf); ++i) {
+		struct index_entry_t *entry = add_index_entry(buf);
+		if (entry && !entry->path) {
+			entry->path = strdup(buf);
+			++_files_count;
+		}
+	}
+	return 1;
+}
+
+static int load_index() {
+	char path[MAXPATHLEN];
+	if (!get_index_path(path, sizeof(path))) {
+		return 0;
+	}
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		return 0;
+	}
+	int ret = 0;
+	fseek(fp, 0, SEEK_END);
+	const long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	uint8_t *buf = (size > 0) ? (uint8_t *)malloc(size) : 0;
+	if (buf) {
+		if (fread(buf, 1, size, fp) == size) {
+			ret = parse_index(buf, buf + size);
+		}
+		free(buf);
+	}
+	fclose(fp);
+	return ret;
+}
+
 #define MAX_FILES 256
 
 struct file_t {
-	FILE *fp;
 	int animation_num;
 	struct file_t *next_free;
 };
@@ -121,20 +519,49 @@ void Resource_Init() {
 	}
 	fprintf(stdout, "Using %s as data files directory\n", path);
 	_data_path = path;
-	list_datafiles(path);
+	const uint32_t t0 = get_time_ms();
+	if (load_index()) {
+		fprintf(stdout, "Loaded data files index in %d ms\n", get_time_ms() - t0);
+	} else {
+		list_datafiles(path);
+		fprintf(stdout, "Scanned data files in %d ms\n", get_time_ms() - t0);
+		save_index();
+	}
+	fprintf(stdout, "Found %d files\n", _files_count);
+	fprintf(stdout, "Found %d zipfiles\n", _zipfiles_count);
 	_next_file = &_files[0];
 	for (int i = 0; i < MAX_FILES - 1; ++i) {
 		_files[i].next_free = &_files[i + 1];
 	}
+	start_preload();
+	Trace_Init(getenv("TRACEFILE"));
 }
 
 void Resource_Fini() {
-	for (int i = 0; i < _filenames_count; ++i) {
-		free(_filenames[i]);
+	stop_preload();
+	Trace_Fini();
+	free_index();
+	_files_count = 0;
+	for (int i = 0; i < _dirs_count; ++i) {
+		free(_dirs[i].path);
 	}
-	_filenames_count = 0;
-	free(_filenames);
-	_filenames = 0;
+	free(_dirs);
+	_dirs = 0;
+	_dirs_count = 0;
+	for (int i = 0; i < MAX_ZIPFILES && _zipfiles[i].name; ++i) {
+		if (_zipfiles[i].bf) {
+			Bakefile_Close(_zipfiles[i].bf);
+			_zipfiles[i].bf = 0;
+		}
+		if (_zipfiles[i].zf) {
+			Zipfile_Close(_zipfiles[i].zf);
+		}
+		free(_zipfiles[i].name);
+		free(_zipfiles[i].path);
+		memset(&_zipfiles[i], 0, sizeof(_zipfiles[i]));
+	}
+	_zipfiles_count = 0;
+	dump_open_stats();
 }
 
 static void fix_path(const char *name, char *buf) {
@@ -154,22 +581,123 @@ static void fix_path(const char *name, char *buf) {
 	*buf = 0;
 }
 
-static FILE *open_file(const char *original_name) {
+static struct index_entry_t *find_file(const char *name, char *key, uint32_t *hash) {
+	const int zipfile = find_zipfile(name);
+	if (!(zipfile < 0)) {
+		get_zipfile(zipfile);
+	}
+	make_key(name, key);
+	*hash = hash_key(key);
+	return find_index_entry(key, *hash);
+}
+
+/* every asset opened (animations, sounds, scripts, xml) is accounted, reported on exit */
+
+#define OPEN_STATS_BUCKETS 256
+
+struct open_stats_t {
+	uint32_t hash;
+	char *key;
+	int opens_count;
+	int failures_count;
+	int64_t bytes_count; /* size of the streams returned */
+	int64_t open_time; /* lookup and open, in microseconds */
+	struct open_stats_t *next;
+};
+
+static struct open_stats_t *_open_stats[OPEN_STATS_BUCKETS];
+static int _open_stats_count;
+
+static void add_open_stats(const char *key, uint32_t hash, int size, int64_t duration) {
+	struct open_stats_t **bucket = &_open_stats[hash & (OPEN_STATS_BUCKETS - 1)];
+	struct open_stats_t *stats = *bucket;
+	while (stats && !(stats->hash == hash && strcmp(stats->key, key) == 0)) {
+		stats = stats->next;
+	}
+	if (!stats) {
+		stats = (struct open_stats_t *)calloc(1, sizeof(struct open_stats_t));
+		if (!stats) {
+			return;
+		}
+		stats->hash = hash;
+		stats->key = strdup(key);
+		stats->next = *bucket;
+		*bucket = stats;
+		++_open_stats_count;
+	}
+	if (size < 0) {
+		++stats->failures_count;
+	} else {
+		++stats->opens_count;
+		stats->bytes_count += size;
+	}
+	stats->open_time += duration;
+}
+
+static int compare_open_stats(const void *a, const void *b) {
+	const struct open_stats_t *stats_a = *(const struct open_stats_t **)a;
+	const struct open_stats_t *stats_b = *(const struct open_stats_t **)b;
+	if (stats_a->open_time != stats_b->open_time) {
+		return (stats_a->open_time < stats_b->open_time) ? 1 : -1;
+	}
+	return strcmp(stats_a->key, stats_b->key);
+}
+
+static void dump_open_stats() {
+	struct open_stats_t **sorted = (struct open_stats_t **)malloc(_open_stats_count * sizeof(struct open_stats_t *));
+	if (sorted) {
+		int count = 0;
+		for (int i = 0; i < OPEN_STATS_BUCKETS; ++i) {
+			for (struct open_stats_t *stats = _open_stats[i]; stats; stats = stats->next) {
+				sorted[count++] = stats;
+			}
+		}
+		qsort(sorted, count, sizeof(struct open_stats_t *), compare_open_stats);
+		fprintf(stdout, "%5s %5s %10s %8s  %s\n", "opens", "fails", "bytes", "open", "asset");
+		for (int i = 0; i < count; ++i) {
+			const struct open_stats_t *stats = sorted[i];
+			fprintf(stdout, "%5d %5d %10lld %8.1f  %s\n",
+				stats->opens_count, stats->failures_count, (long long)stats->bytes_count,
+				stats->open_time / 1000., stats->key);
+		}
+		free(sorted);
+	}
+	for (int i = 0; i < OPEN_STATS_BUCKETS; ++i) {
+		while (_open_stats[i]) {
+			struct open_stats_t *next = _open_stats[i]->next;
+			free(_open_stats[i]->key);
+			free(_open_stats[i]);
+			_open_stats[i] = next;
+		}
+	}
+	_open_stats_count = 0;
+}
+
+static int get_file_size(FILE *fp) {
+	struct stat st;
+	if (fstat(fileno(fp), &st) == 0) {
+		return st.st_size;
+	}
+	return 0;
+}
+
+static FILE *open_data_file(const char *original_name) {
+	const uint32_t start_time = get_time_us();
 	char name[MAXPATHLEN];
 	fix_path(original_name, name);
+	char key[MAXPATHLEN];
+	uint32_t hash;
+	struct index_entry_t *entry = find_file(name, key, &hash);
+	if (!entry && is_negative_cached(key, hash)) {
+		add_open_stats(key, hash, -1, get_time_us() - start_time);
+		return 0;
+	}
 	FILE *fp = 0;
-	const char *sep = strchr(name, '/');
-	if (sep) {
-		const char *filepath = sep + 1;
-		for (int i = 0; i < MAX_ZIPFILES && _zipfiles[i].name; ++i) {
-			if (strncasecmp(_zipfiles[i].name, name, sep - name) == 0) {
-				struct zipentry_t *ze = Zipfile_Find(_zipfiles[i].zf, filepath);
-				// fprintf(stdout, "%s in zipfile %s, ze %p\n", name, _zipfiles[i].name, (void *)ze);
-				if (ze && Zipfile_GetEntrySize(_zipfiles[i].zf, ze) != 0) {
-					fp = Zipfile_OpenEntry(_zipfiles[i].zf, ze);
-				}
-				break;
-			}
+	int size = -1;
+	if (entry && entry->ze) {
+		fp = Zipfile_OpenEntry(entry->zf, entry->ze);
+		if (fp) {
+			size = Zipfile_GetEntrySize(entry->zf, entry->ze);
 		}
 	}
 	if (!fp) {
@@ -178,67 +706,342 @@ static FILE *open_file(const char *original_name) {
 	}
 	if (!fp) {
 		char buf[MAXPATHLEN];
-		snprintf(buf, sizeof(buf), "%s/%s", _data_path, name);
-		fp = fopen(buf, "rb");
 		/* case insensitive */
-		if (!fp) {
-			for (int i = 0; i < _filenames_count; ++i) {
-				if (strcasecmp(buf + strlen(_data_path) + 1, _filenames[i]) == 0) {
-					snprintf(buf, sizeof(buf), "%s/%s", _data_path, _filenames[i]);
-					fp = fopen(buf, "rb");
-					break;
-				}
-			}
-		}
+		snprintf(buf, sizeof(buf), "%s/%s", _data_path, (entry && entry->path) ? entry->path : name);
+		fp = fopen(buf, "rb");
 	}
 	if (!fp) {
 		fprintf(stderr, "Failed to open '%s'\n", name);
+		add_negative_cache(key, hash);
+		add_open_stats(key, hash, -1, get_time_us() - start_time);
 		return 0;
 	}
+	if (size < 0) {
+		size = get_file_size(fp);
+	}
+	add_open_stats(key, hash, size, get_time_us() - start_time);
+	return fp;
+}
+
+static FILE *open_file(const char *name) {
+	pthread_mutex_lock(&_lock);
+	FILE *fp = open_data_file(name);
+	pthread_mutex_unlock(&_lock);
 	return fp;
 }
 
+static int exists_data_file(const char *original_name) {
+	char name[MAXPATHLEN];
+	fix_path(original_name, name);
+	char key[MAXPATHLEN];
+	uint32_t hash;
+	if (find_file(name, key, &hash)) {
+		/* no need to access the file data */
+		return 1;
+	}
+	if (is_negative_cached(key, hash)) {
+		return 0;
+	}
+	char buf[MAXPATHLEN * 2];
+	snprintf(buf, sizeof(buf), "%s/%s", _data_path, name);
+	if (access(name, R_OK) == 0 || access(buf, R_OK) == 0) {
+		return 1;
+	}
+	add_negative_cache(key, hash);
+	return 0;
+}
+
 int Resource_Exists(const char *name) {
+	pthread_mutex_lock(&_lock);
+	const int ret = exists_data_file(name);
+	pthread_mutex_unlock(&_lock);
+	return ret;
+}
+
+static void trace_access(const char *key);
+
+FILE *Resource_Open(const char *name) {
+	char path[MAXPATHLEN];
+	fix_path(name, path);
+	char key[MAXPATHLEN];
+	make_key(path, key);
+	trace_access(key);
+	return open_file(name);
+}
+
+static const uint8_t *find_baked(const char *original_name) {
+	char name[MAXPATHLEN];
+	fix_path(original_name, name);
+	const int zipfile = find_zipfile(name);
+	if (!(zipfile < 0) && _zipfiles[zipfile].bf) {
+		return Bakefile_Find(_zipfiles[zipfile].bf, strchr(name, '/') + 1);
+	}
+	return 0;
+}
+
+/* animations requested ahead of time are loaded in the cache by a background thread */
+
+struct preload_t {
+	char *name;
+	char *key;
+	struct preload_t *next;
+};
+
+static pthread_t _preload_thread;
+static bool _preload_started;
+static bool _preload_quit;
+static pthread_mutex_t _preload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _preload_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _preload_done = PTHREAD_COND_INITIALIZER;
+static struct preload_t *_preload_head, *_preload_tail;
+static struct preload_t *_preload_current;
+
+static void free_preload(struct preload_t *p) {
+	free(p->name);
+	free(p->key);
+	free(p);
+}
+
+static void preload_animation(const char *name, const char *key) {
+	if (find_baked(name)) {
+		/* already decoded */
+		return;
+	}
+	const uint32_t t0 = get_time_us();
 	FILE *fp = open_file(name);
+	Animation_AddLookupTime(key, get_time_us() - t0);
 	if (fp) {
+		Animation_Preload(fp, strrchr(name, '.') + 1, key);
 		fclose(fp);
-		return 1;
 	}
+}
+
+static void *preload_thread(void *param) {
+	pthread_mutex_lock(&_preload_mutex);
+	while (!_preload_quit) {
+		struct preload_t *p = _preload_head;
+		if (!p) {
+			pthread_cond_wait(&_preload_queued, &_preload_mutex);
+			continue;
+		}
+		_preload_head = p->next;
+		if (!_preload_head) {
+			_preload_tail = 0;
+		}
+		_preload_current = p;
+		pthread_mutex_unlock(&_preload_mutex);
+		preload_animation(p->name, p->key);
+		pthread_mutex_lock(&_preload_mutex);
+		_preload_current = 0;
+		free_preload(p);
+		pthread_cond_broadcast(&_preload_done);
+	}
+	pthread_mutex_unlock(&_preload_mutex);
 	return 0;
 }
 
-FILE *Resource_Open(const char *name) {
-	return open_file(name);
+static void start_preload() {
+	_preload_quit = false;
+	if (pthread_create(&_preload_thread, 0, preload_thread, 0) != 0) {
+		fprintf(stderr, "Failed to create preload thread\n");
+		return;
+	}
+	_preload_started = true;
+}
+
+static void flush_preload() {
+	while (_preload_head) {
+		struct preload_t *next = _preload_head->next;
+		free_preload(_preload_head);
+		_preload_head = next;
+	}
+	_preload_tail = 0;
+}
+
+static void stop_preload() {
+	if (_preload_started) {
+		pthread_mutex_lock(&_preload_mutex);
+		flush_preload();
+		_preload_quit = true;
+		pthread_cond_signal(&_preload_queued);
+		pthread_mutex_unlock(&_preload_mutex);
+		pthread_join(_preload_thread, 0);
+		_preload_started = false;
+	}
+}
+
+/* called with the preload mutex held */
+static bool is_preload_pending(const char *key) {
+	if (_preload_current && strcmp(_preload_current->key, key) == 0) {
+		return true;
+	}
+	for (struct preload_t *p = _preload_head; p; p = p->next) {
+		if (strcmp(p->key, key) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void wait_preload(const char *key) {
+	pthread_mutex_lock(&_preload_mutex);
+	/* a queued request is loaded by the caller */
+	struct preload_t *prev = 0;
+	for (struct preload_t *p = _preload_head; p; prev = p, p = p->next) {
+		if (strcmp(p->key, key) == 0) {
+			if (prev) {
+				prev->next = p->next;
+			} else {
+				_preload_head = p->next;
+			}
+			if (_preload_tail == p) {
+				_preload_tail = prev;
+			}
+			free_preload(p);
+			break;
+		}
+	}
+	while (_preload_current && strcmp(_preload_current->key, key) == 0) {
+		pthread_cond_wait(&_preload_done, &_preload_mutex);
+	}
+	pthread_mutex_unlock(&_preload_mutex);
+}
+
+void Resource_Preload(const char *name) {
+	const char *ext = strrchr(name, '.');
+	if (!ext || (strcasecmp(ext + 1, "mng") != 0 && strcasecmp(ext + 1, "rle") != 0)) {
+		return;
+	}
+	char path[MAXPATHLEN];
+	fix_path(name, path);
+	char key[MAXPATHLEN];
+	make_key(path, key);
+	pthread_mutex_lock(&_preload_mutex);
+	if (_preload_started && !is_preload_pending(key)) {
+		struct preload_t *p = (struct preload_t *)calloc(1, sizeof(struct preload_t));
+		if (p) {
+			p->name = strdup(name);
+			p->key = strdup(key);
+			if (_preload_tail) {
+				_preload_tail->next = p;
+			} else {
+				_preload_head = p;
+			}
+			_preload_tail = p;
+			pthread_cond_signal(&_preload_queued);
+		}
+	}
+	pthread_mutex_unlock(&_preload_mutex);
+}
+
+int Resource_IsPreloaded(const char *name) {
+	char path[MAXPATHLEN];
+	fix_path(name, path);
+	char key[MAXPATHLEN];
+	make_key(path, key);
+	pthread_mutex_lock(&_preload_mutex);
+	const bool pending = is_preload_pending(key);
+	pthread_mutex_unlock(&_preload_mutex);
+	return !pending && Animation_IsReady(key);
+}
+
+void Resource_FlushPreloadQueue(int wait) {
+	pthread_mutex_lock(&_preload_mutex);
+	if (!wait) {
+		flush_preload();
+	}
+	while (_preload_head || _preload_current) {
+		pthread_cond_wait(&_preload_done, &_preload_mutex);
+	}
+	pthread_mutex_unlock(&_preload_mutex);
+}
+
+/* the assets likely to be requested next are read ahead */
+
+static void prefetch_file(const char *key) {
+	pthread_mutex_lock(&_lock);
+	char buf[MAXPATHLEN];
+	uint32_t hash;
+	struct index_entry_t *entry = find_file(key, buf, &hash);
+	if (entry && entry->ze) {
+		Zipfile_MapEntry(entry->zf, entry->ze, ZIPFILE_ADVICE_WILLNEED);
+	} else if (entry && entry->path) {
+		snprintf(buf, sizeof(buf), "%s/%s", _data_path, entry->path);
+		const int fd = open(buf, O_RDONLY);
+		if (!(fd < 0)) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+			close(fd);
+		}
+	}
+	pthread_mutex_unlock(&_lock);
+}
+
+static void prefetch(const char **keys, int count) {
+	for (int i = 0; i < count; ++i) {
+		const char *ext = strrchr(keys[i], '.');
+		if (ext && (strcmp(ext + 1, "mng") == 0 || strcmp(ext + 1, "rle") == 0)) {
+			Resource_Preload(keys[i]);
+		} else {
+			prefetch_file(keys[i]);
+		}
+	}
+}
+
+static void trace_access(const char *key) {
+	const char *predicted[MAX_PREFETCH];
+	const int count = Trace_Access(key, predicted);
+	prefetch(predicted, count);
+}
+
+void Resource_SetTraceContext(const char *name) {
+	const char *predicted[MAX_PREFETCH];
+	const int count = Trace_SetContext(name, predicted);
+	prefetch(predicted, count);
 }
 
 int Resource_LoadAnimation(const char *name) {
-	FILE *fp = open_file(name);
-	if (!fp) {
-		return -1;
+	char path[MAXPATHLEN];
+	fix_path(name, path);
+	char key[MAXPATHLEN];
+	make_key(path, key);
+	trace_access(key);
+	wait_preload(key);
+	/* decoded animations are shared */
+	int anim = Animation_Open(key, _loading_mode);
+	if (anim < 0) {
+		const uint32_t t0 = get_time_us();
+		const uint8_t *baked = find_baked(name);
+		if (baked) {
+			Animation_AddLookupTime(key, get_time_us() - t0);
+			anim = Animation_LoadBaked(baked, key);
+		} else {
+			FILE *fp = open_file(name);
+			Animation_AddLookupTime(key, get_time_us() - t0);
+			if (!fp) {
+				return -1;
+			}
+			const char *ext = strrchr(name, '.');
+			if (ext) {
+				anim = Animation_Load(fp, ext + 1, key, _loading_mode);
+				// fprintf(stdout, "animation %s asset %d\n", ext, anim);
+			}
+			/* the file data is not needed once the layers have been queued for decoding */
+			fclose(fp);
+		}
 	}
 	struct file_t *file = find_free_file();
 	if (!file) {
-		fclose(fp);
+		if (!(anim < 0)) {
+			Animation_Free(anim);
+		}
 		return -1;
 	}
-	const int num = file - _files;
-	file->fp = fp;
-	const char *ext = strrchr(name, '.');
-	if (ext) {
-		file->animation_num = Animation_Load(fp, ext + 1);
-		// fprintf(stdout, "animation %s num %d asset %d\n", ext, num, file->animation_num);
-	} else {
-		file->animation_num = -1;
-	}
-	return num;
+	file->animation_num = anim;
+	return file - _files;
 }
 
 void Resource_FreeAnimation(int num) {
 	struct file_t *file = &_files[num];
-	if (file->fp) {
-		fclose(file->fp);
-		file->fp = 0;
-	}
 	if (!(file->animation_num < 0)) {
 		Animation_Free(file->animation_num);
 		file->animation_num = -1;
@@ -246,6 +1049,23 @@ void Resource_FreeAnimation(int num) {
 	free_file(file);
 }
 
+const struct anim_stats_t *Resource_GetAnimationStats(const char *name) {
+	char path[MAXPATHLEN];
+	fix_path(name, path);
+	char key[MAXPATHLEN];
+	make_key(path, key);
+	return Animation_GetStats(key);
+}
+
 int Resource_GetAnimationIndex(int num) {
 	return _files[num].animation_num;
 }
+
+int Resource_IsAnimationLoaded(int num) {
+	const int anim = _files[num].animation_num;
+	return anim < 0 || Animation_IsLoaded(anim);
+}
+
+void Resource_SetLoadingMode(int mode) {
+	_loading_mode = mode;
+}
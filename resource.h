@@ -12,5 +12,12 @@ FILE *Resource_Open(const char *name);
 int Resource_LoadAnimation(const char *name);
 void Resource_FreeAnimation(int num);
 int Resource_GetAnimationIndex(int num);
+int Resource_IsAnimationLoaded(int num);
+const struct anim_stats_t *Resource_GetAnimationStats(const char *name);
+void Resource_SetLoadingMode(int mode);
+void Resource_Preload(const char *name);
+int Resource_IsPreloaded(const char *name);
+void Resource_FlushPreloadQueue(int wait);
+void Resource_SetTraceContext(const char *name);
 
 #endif // RESOURCE_H__
@@ -9,7 +9,8 @@
 #define INPUT_DIRECTION_UP    (1 << 2)
 #define INPUT_DIRECTION_DOWN  (1 << 3)
 
-#define SYS_AUDIO_FREQ 22050
+#define SYS_AUDIO_FREQ    22050
+#define SYS_AUDIO_SAMPLES 2048
 
 struct event_t {
 	enum {
@@ -72,7 +73,9 @@ void	System_UpdateScreenYUV(int w, int h, const uint8_t *ydata, int ysize, const
 int	System_LoadCursor(const uint32_t *rgba, int w, int h);
 void	System_SetCursor(int num);
 bool	System_PollEvent(struct event_t *ev);
-void	System_StartAudio(SysAudioCb callback, void *param);
+int	System_GetNativeAudioFreq();
+int	System_OpenAudio(int *freq, int *samples, SysAudioCb callback, void *param);
+void	System_StartAudio();
 void	System_StopAudio();
 void	System_LockAudio();
 void	System_UnlockAudio();
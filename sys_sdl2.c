@@ -20,6 +20,7 @@ static struct cursor_t _cursors[MAX_CURSORS];
 static int _cursors_count;
 static bool _fullscreen;
 static bool _screen_yuv;
+static SDL_AudioDeviceID _audio_device;
 
 static void init_screen(int w, int h, bool fullscreen) {
 	const int flags = fullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : SDL_WINDOW_RESIZABLE;
@@ -246,28 +247,57 @@ bool System_PollEvent(struct event_t *event) {
 	return false;
 }
 
-void System_StartAudio(SysAudioCb callback, void *param) {
-	SDL_AudioSpec desired;
+int System_GetNativeAudioFreq() {
+	SDL_AudioSpec spec;
+#if SDL_VERSION_ATLEAST(2, 24, 0)
+	if (SDL_GetDefaultAudioInfo(0, &spec, 0) == 0) {
+		return spec.freq;
+	}
+#elif SDL_VERSION_ATLEAST(2, 0, 16)
+	if (SDL_GetAudioDeviceSpec(0, 0, &spec) == 0) {
+		return spec.freq;
+	}
+#endif
+	return SYS_AUDIO_FREQ;
+}
+
+/* the device is opened paused, the frequency and buffer size are updated with the values obtained */
+int System_OpenAudio(int *freq, int *samples, SysAudioCb callback, void *param) {
+	SDL_AudioSpec desired, obtained;
 	memset(&desired, 0, sizeof(desired));
-	desired.freq = SYS_AUDIO_FREQ;
+	desired.freq = *freq;
 	desired.format = AUDIO_S16;
 	desired.channels = 2;
-	desired.samples = 2048;
+	desired.samples = *samples;
 	desired.callback = callback;
 	desired.userdata = param;
-	if (SDL_OpenAudio(&desired, 0) == 0) {
-		SDL_PauseAudio(0);
+	_audio_device = SDL_OpenAudioDevice(0, 0, &desired, &obtained, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+	if (_audio_device == 0) {
+		fprintf(stderr, "Failed to open audio device: %s\n", SDL_GetError());
+		return -1;
+	}
+	*freq = obtained.freq;
+	*samples = obtained.samples;
+	return 0;
+}
+
+void System_StartAudio() {
+	if (_audio_device) {
+		SDL_PauseAudioDevice(_audio_device, 0);
 	}
 }
 
 void System_StopAudio() {
-	SDL_CloseAudio();
+	if (_audio_device) {
+		SDL_CloseAudioDevice(_audio_device);
+		_audio_device = 0;
+	}
 }
 
 void System_LockAudio() {
-	SDL_LockAudio();
+	SDL_LockAudioDevice(_audio_device);
 }
 
 void System_UnlockAudio() {
-	SDL_UnlockAudio();
+	SDL_UnlockAudioDevice(_audio_device);
 }
@@ -0,0 +1,225 @@
+
+#include <sys/param.h>
+#include <time.h>
+#include "trace.h"
+
+struct trace_next_t {
+	struct trace_node_t *node;
+	int count;
+	struct trace_next_t *next;
+};
+
+struct trace_node_t {
+	uint32_t hash;
+	char *key; /* asset path, or '@' followed by the context name */
+	struct trace_next_t *next_list;
+	int next_total;
+	bool prefetched;
+	struct trace_node_t *next;
+};
+
+#define TRACE_BUCKETS 1024
+
+static struct trace_node_t *_nodes[TRACE_BUCKETS];
+static FILE *_fp;
+static uint32_t _start_ms;
+static char _context[64];
+static struct trace_node_t *_context_node;
+static struct trace_node_t *_prev_node;
+static int _prefetched_count;
+static int _hits_count;
+
+static struct trace_node_t *get_node(const char *key) {
+	const uint32_t hash = hash_key(key);
+	struct trace_node_t **bucket = &_nodes[hash & (TRACE_BUCKETS - 1)];
+	for (struct trace_node_t *node = *bucket; node; node = node->next) {
+		if (node->hash == hash && strcmp(node->key, key) == 0) {
+			return node;
+		}
+	}
+	struct trace_node_t *node = (struct trace_node_t *)calloc(1, sizeof(struct trace_node_t));
+	if (node) {
+		node->hash = hash;
+		node->key = strdup(key);
+		node->next = *bucket;
+		*bucket = node;
+	}
+	return node;
+}
+
+static struct trace_node_t *get_context_node(const char *name) {
+	char key[MAXPATHLEN];
+	snprintf(key, sizeof(key), "@%s", name);
+	return get_node(key);
+}
+
+static void add_transition(struct trace_node_t *from, struct trace_node_t *to) {
+	if (!from || !to || from == to) {
+		return;
+	}
+	struct trace_next_t *next = from->next_list;
+	for (; next; next = next->next) {
+		if (next->node == to) {
+			break;
+		}
+	}
+	if (!next) {
+		next = (struct trace_next_t *)calloc(1, sizeof(struct trace_next_t));
+		if (!next) {
+			return;
+		}
+		next->node = to;
+		next->next = from->next_list;
+		from->next_list = next;
+	}
+	++next->count;
+	++from->next_total;
+}
+
+/* returns the most frequent successors, ignoring the ones seen in less than a quarter of the transitions */
+static int predict(struct trace_node_t *node, const char **predicted) {
+	struct trace_next_t *best[MAX_PREFETCH];
+	int count = 0;
+	for (struct trace_next_t *next = node->next_list; next; next = next->next) {
+		if (next->node->prefetched || next->count * 4 < node->next_total) {
+			continue;
+		}
+		if (count < MAX_PREFETCH) {
+			best[count++] = next;
+		} else if (best[count - 1]->count < next->count) {
+			best[count - 1] = next;
+		} else {
+			continue;
+		}
+		for (int i = count - 1; i > 0 && best[i - 1]->count < best[i]->count; --i) {
+			struct trace_next_t *tmp = best[i - 1];
+			best[i - 1] = best[i];
+			best[i] = tmp;
+		}
+	}
+	for (int i = 0; i < count; ++i) {
+		best[i]->node->prefetched = true;
+		predicted[i] = best[i]->node->key;
+	}
+	_prefetched_count += count;
+	return count;
+}
+
+/* each line is the time in milliseconds, the context and the asset path separated by tabs */
+
+static int load_traces(FILE *fp) {
+	int sessions_count = 0;
+	struct trace_node_t *prev = 0;
+	char prev_context[64] = "";
+	char line[MAXPATHLEN + 128];
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (strncmp(line, "session", 7) == 0) {
+			prev = 0;
+			prev_context[0] = 0;
+			++sessions_count;
+			continue;
+		}
+		char *context = strchr(line, '\t');
+		if (!context) {
+			continue;
+		}
+		*context++ = 0;
+		char *key = strchr(context, '\t');
+		if (!key) {
+			continue;
+		}
+		*key++ = 0;
+		struct trace_node_t *node = get_node(key);
+		if (context[0] && strcmp(context, prev_context) != 0) {
+			add_transition(get_context_node(context), node);
+			snprintf(prev_context, sizeof(prev_context), "%s", context);
+		}
+		add_transition(prev, node);
+		prev = node;
+	}
+	return sessions_count;
+}
+
+void Trace_Init(const char *path) {
+	if (!path) {
+		return;
+	}
+	FILE *fp = fopen(path, "r");
+	if (fp) {
+		const int count = load_traces(fp);
+		fclose(fp);
+		fprintf(stdout, "Loaded %d asset traces from '%s'\n", count, path);
+	}
+	_fp = fopen(path, "a");
+	if (!_fp) {
+		fprintf(stderr, "Failed to open '%s'\n", path);
+		return;
+	}
+	fprintf(_fp, "session %ld\n", (long)time(0));
+	_start_ms = get_time_ms();
+}
+
+void Trace_Fini() {
+	if (!_fp) {
+		return;
+	}
+	fclose(_fp);
+	_fp = 0;
+	int wasted_count = 0;
+	for (int i = 0; i < TRACE_BUCKETS; ++i) {
+		for (struct trace_node_t *node = _nodes[i]; node; ) {
+			struct trace_node_t *next_node = node->next;
+			if (node->prefetched) {
+				++wasted_count;
+			}
+			for (struct trace_next_t *next = node->next_list; next; ) {
+				struct trace_next_t *next_next = next->next;
+				free(next);
+				next = next_next;
+			}
+			free(node->key);
+			free(node);
+			node = next_node;
+		}
+		_nodes[i] = 0;
+	}
+	if (_prefetched_count != 0) {
+		fprintf(stdout, "Prefetched %d assets, %d hits (%d%%), %d wasted\n", _prefetched_count, _hits_count, _hits_count * 100 / _prefetched_count, wasted_count);
+	}
+	_prefetched_count = _hits_count = 0;
+	_context[0] = 0;
+	_context_node = _prev_node = 0;
+}
+
+int Trace_SetContext(const char *name, const char **predicted) {
+	if (!_fp) {
+		return 0;
+	}
+	snprintf(_context, sizeof(_context), "%s", name);
+	_context_node = get_context_node(_context);
+	return _context_node ? predict(_context_node, predicted) : 0;
+}
+
+int Trace_Access(const char *key, const char **predicted) {
+	if (!_fp) {
+		return 0;
+	}
+	fprintf(_fp, "%d\t%s\t%s\n", (int)(get_time_ms() - _start_ms), _context, key);
+	struct trace_node_t *node = get_node(key);
+	if (!node) {
+		return 0;
+	}
+	if (node->prefetched) {
+		node->prefetched = false;
+		++_hits_count;
+	}
+	/* the current session is also learned from */
+	if (_context_node) {
+		add_transition(_context_node, node);
+		_context_node = 0;
+	}
+	add_transition(_prev_node, node);
+	_prev_node = node;
+	return predict(node, predicted);
+}
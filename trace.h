@@ -0,0 +1,17 @@
+
+#ifndef TRACE_H__
+#define TRACE_H__
+
+#include "intern.h"
+
+#define MAX_PREFETCH 4
+
+/* the sequences of assets recorded in previous sessions are used to predict the next accesses */
+
+void Trace_Init(const char *path);
+void Trace_Fini();
+
+int Trace_SetContext(const char *name, const char **predicted);
+int Trace_Access(const char *key, const char **predicted);
+
+#endif // TRACE_H__
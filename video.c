@@ -1,5 +1,6 @@
 
 #include <libavcodec/avcodec.h>
+#include "memory.h"
 #include "sys.h"
 #include "video.h"
 
@@ -18,6 +19,7 @@ struct video_t {
 	int current_frame;
 	AVCodecContext *context;
 	AVFrame *frame;
+	int memory_size;
 };
 
 static struct video_t _current_video;
@@ -93,6 +95,9 @@ int Video_PlayVideo(FILE *fp) {
 
 	avcodec_open2(_current_video.context, _codec, 0);
 	_current_video.frame = av_frame_alloc();
+	/* estimated as the frames offsets and one decoded YUV 4:2:0 picture, the reference frames and the buffers allocated inside libavcodec are not counted */
+	_current_video.memory_size = (_current_video.frames_count + 1) * sizeof(uint32_t) + _current_video.w * _current_video.h * 3 / 2;
+	Memory_Add(MEMORY_VIDEO, _current_video.memory_size);
 	return 0;
 }
 
@@ -106,6 +111,7 @@ int Video_StopVideo(int video) {
 		_current_video.frame = 0;
 	}
 	free(_current_video.frames_offset);
+	Memory_Add(MEMORY_VIDEO, -_current_video.memory_size);
 	memset(&_current_video, 0, sizeof(_current_video));
 	return 0;
 }
@@ -0,0 +1,121 @@
+
+#include <pthread.h>
+#include <unistd.h>
+#include "worker.h"
+
+#define MAX_THREADS 8
+
+static pthread_t _threads[MAX_THREADS];
+static int _threads_count;
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _done = PTHREAD_COND_INITIALIZER;
+static struct worker_job_t *_head, *_tail;
+static bool _quit;
+
+/* called with the mutex held, returns with the mutex held */
+static void run_job(struct worker_job_t *job) {
+	/* the job memory may be released by its own proc */
+	struct worker_group_t *group = job->group;
+	pthread_mutex_unlock(&_mutex);
+	job->proc(job->param);
+	pthread_mutex_lock(&_mutex);
+	if (--group->pending == 0) {
+		pthread_cond_broadcast(&_done);
+	}
+}
+
+static struct worker_job_t *pop_job(struct worker_group_t *group) {
+	struct worker_job_t *prev = 0;
+	for (struct worker_job_t *job = _head; job; prev = job, job = job->next) {
+		if (group && job->group != group) {
+			continue;
+		}
+		if (prev) {
+			prev->next = job->next;
+		} else {
+			_head = job->next;
+		}
+		if (_tail == job) {
+			_tail = prev;
+		}
+		job->next = 0;
+		return job;
+	}
+	return 0;
+}
+
+static void *worker_thread(void *param) {
+	pthread_mutex_lock(&_mutex);
+	while (!_quit) {
+		struct worker_job_t *job = pop_job(0);
+		if (job) {
+			run_job(job);
+		} else {
+			pthread_cond_wait(&_queued, &_mutex);
+		}
+	}
+	pthread_mutex_unlock(&_mutex);
+	return 0;
+}
+
+int Worker_Init() {
+	/* the thread waiting on a group also runs jobs, keep one thread for background decoding */
+	const int count = MAX(1, MIN(sysconf(_SC_NPROCESSORS_ONLN) - 1, MAX_THREADS));
+	_quit = false;
+	for (int i = 0; i < count; ++i) {
+		if (pthread_create(&_threads[_threads_count], 0, worker_thread, 0) != 0) {
+			fprintf(stderr, "Failed to create worker thread\n");
+			break;
+		}
+		++_threads_count;
+	}
+	fprintf(stdout, "Using %d worker threads\n", _threads_count);
+	return 0;
+}
+
+int Worker_Fini() {
+	pthread_mutex_lock(&_mutex);
+	_quit = true;
+	pthread_cond_broadcast(&_queued);
+	pthread_mutex_unlock(&_mutex);
+	for (int i = 0; i < _threads_count; ++i) {
+		pthread_join(_threads[i], 0);
+	}
+	_threads_count = 0;
+	return 0;
+}
+
+void Worker_Queue(struct worker_job_t *job) {
+	pthread_mutex_lock(&_mutex);
+	++job->group->pending;
+	job->next = 0;
+	if (_tail) {
+		_tail->next = job;
+	} else {
+		_head = job;
+	}
+	_tail = job;
+	pthread_cond_signal(&_queued);
+	pthread_mutex_unlock(&_mutex);
+}
+
+int Worker_IsDone(struct worker_group_t *group) {
+	pthread_mutex_lock(&_mutex);
+	const int done = (group->pending == 0);
+	pthread_mutex_unlock(&_mutex);
+	return done;
+}
+
+void Worker_Wait(struct worker_group_t *group) {
+	pthread_mutex_lock(&_mutex);
+	while (group->pending != 0) {
+		struct worker_job_t *job = pop_job(group);
+		if (job) {
+			run_job(job);
+		} else {
+			pthread_cond_wait(&_done, &_mutex);
+		}
+	}
+	pthread_mutex_unlock(&_mutex);
+}
@@ -0,0 +1,27 @@
+
+#ifndef WORKER_H__
+#define WORKER_H__
+
+#include "intern.h"
+
+typedef void (*WorkerProc)(void *);
+
+struct worker_group_t {
+	int pending;
+};
+
+struct worker_job_t {
+	WorkerProc proc;
+	void *param;
+	struct worker_group_t *group;
+	struct worker_job_t *next;
+};
+
+int Worker_Init();
+int Worker_Fini();
+
+void Worker_Queue(struct worker_job_t *job);
+void Worker_Wait(struct worker_group_t *group);
+int Worker_IsDone(struct worker_group_t *group);
+
+#endif
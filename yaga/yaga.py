@@ -1,3 +1,5 @@
+import yagahost
+
 
 class Profiler(object):
 	def __init__(self):
@@ -6,7 +8,7 @@ class Profiler(object):
 		print('STUB: Profiler.AddProfileKey name:' + name)
 	def StartLogSession(self, name):
 		# print('STUB: Profiler.StartLogSession name:' + name)
-		pass
+		yagahost.SetAssetTraceContext(name)
 	def EndLogSession(self, name):
 		# print('STUB: Profiler.EndLogSession name:' + name)
 		pass
@@ -23,8 +25,6 @@ MINIMUM_MEMORY_REQUIRED = 48000 * 1024
 
 class SystemImpl(object):
 	def __init__(self):
-		self.systemMemoryTotal = MINIMUM_MEMORY_REQUIRED
-		self.systemMemoryAvail = MINIMUM_MEMORY_REQUIRED
 		self.counterU32 = 0
 		self.profiler = Profiler()
 		if TOGGLE_GAME_DEBUG_GLOBALS:
@@ -37,6 +37,17 @@ class SystemImpl(object):
 		counter = self.counterU32
 		#self.counterU32 = (self.counterU32 + 1) & 0xFFFFFFFF
 		return counter
+	# the host values are capped by the total memory budget, if set
+	def GetSystemMemoryTotal(self):
+		total, avail = yagahost.GetSystemMemory()
+		return total or MINIMUM_MEMORY_REQUIRED
+	def GetSystemMemoryAvail(self):
+		total, avail = yagahost.GetSystemMemory()
+		if total == 0:
+			return MINIMUM_MEMORY_REQUIRED
+		return avail
+	systemMemoryTotal = property(GetSystemMemoryTotal)
+	systemMemoryAvail = property(GetSystemMemoryAvail)
 
 g_system = SystemImpl()
 
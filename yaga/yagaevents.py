@@ -1,4 +1,5 @@
 
+import bisect
 import struct
 import time
 import yagahost
@@ -75,6 +76,9 @@ class EvbAttribute(object):
 class EvbData(object):
 	def __init__(self):
 		self.data = None
+		self.masks = []
+		self.positions = []
+		self.hasMasks = False
 	def Load(self, f):
 		size = struct.unpack("<I", f.read(4))[0]
 		count = struct.unpack("<I", f.read(4))[0]
@@ -89,10 +93,20 @@ class EvbData(object):
 				a, b = self.Load_3c8c(f)
 			data.append( (pos, c, a, b) )
 		self.data = data
+		# the event records are interleaved with the masks
+		self.masks = [ d for d in data if d[1] == 0x7ab7 ]
+		self.positions = [ d[0] for d in self.masks ]
+		self.hasMasks = len(self.masks) != 0
 	def GetData(self, num):
 		if num >= 0 and num < len(self.data):
 			return self.data[num]
 		return None
+	def GetMaskAt(self, pos):
+		# last mask starting before pos, the positions are in seconds
+		num = bisect.bisect_right(self.positions, pos) - 1
+		if num >= 0:
+			return self.masks[num]
+		return None
 	def Load_7ab7(self, f):
 		mask = struct.unpack("<I", f.read(4))[0]
 		b = struct.unpack("<I", f.read(4))[0]
@@ -173,12 +187,17 @@ class EventStreamPlayback(object):
 			assert c == 0x3c8c
 			return event_elements
 		return None
+	def HasMasks(self):
+		return self.stream is not None and self.stream._ev.hasMasks
 	def MaskData(self, num):
-		data = self.stream._ev.GetData(num)
+		return self._mask(self.stream._ev.GetData(num))
+	def MaskDataAt(self, pos):
+		return self._mask(self.stream._ev.GetMaskAt(pos))
+	def _mask(self, data):
 		if data:
 			pos, c, mask, unk = data
-			assert c == 0x7ab7
-			return mask
+			if c == 0x7ab7:
+				return mask
 		return None
 
 class Event(object):
@@ -12,6 +12,26 @@ def YagaAssetExists(f):
 
 os.path.isfile = YagaAssetExists
 
+# animations return once their first frame is decoded, the others are decoded in the background
+ASSET_LOADING_MODE = yagahost.ASSET_LOAD_PROGRESSIVE
+
+yagahost.SetAssetLoadingMode(ASSET_LOADING_MODE)
+
+# freed animations are kept decoded, the least recently used are discarded above that size
+ASSET_CACHE_SIZE = 32 * 1024 * 1024
+
+yagahost.SetAssetCacheSize(ASSET_CACHE_SIZE)
+
+# memory budgets, 0 for no limit, the decoded animations are discarded from the cache above them
+LAYERS_MEMORY_BUDGET = 0
+TOTAL_MEMORY_BUDGET = 0
+
+yagahost.SetMemoryBudget(yagahost.MEMORY_LAYERS, LAYERS_MEMORY_BUDGET)
+yagahost.SetMemoryBudget(yagahost.MEMORY_TOTAL, TOTAL_MEMORY_BUDGET)
+
+# pending preloads are cancelled on flush, set to 1 to wait for them instead
+ASSET_PRELOAD_FLUSH_WAIT = 0
+
 class ResourceData(object):
 	def __init__(self, path, num):
 		self.path = path
@@ -19,13 +39,14 @@ class ResourceData(object):
 	def __del__(self):
 		# print('STUB: ResourceData.__del__ path:' + self.path + ' num:' + str(self.num))
 		yagahost.FreeAsset(self.num)
+	def isLoaded(self):
+		return yagahost.IsAssetLoaded(self.num)
 
 class ResourceHandle(object):
 	def __init__(self, path):
 		self.path = path
 	def isLoaded(self):
-		print('STUB: ResourceHandle.isLoaded path:' + self.path)
-		return False
+		return yagahost.IsAssetPreloaded(self.path)
 
 class ResourceStream(object):
 	def __init__(self, path, f):
@@ -34,15 +55,18 @@ class ResourceStream(object):
 
 class ResourceManagerImpl(object):
 	def __init__(self):
-		self.cacheBytes = 0
+		pass
+	def GetCacheBytes(self):
+		return yagahost.GetMemoryStats()['cached']
+	cacheBytes = property(GetCacheBytes)
 	def RegisterFormatHandler(self, handler):
 		pass
 	def UnregisterFormatHandler(self, name):
 		pass
 	def FlushPreloadQueue(self):
-		print('STUB: ResourceManagerImpl.FlushPreloadQueue')
+		yagahost.FlushPreloadQueue(ASSET_PRELOAD_FLUSH_WAIT)
 	def Preload(self, path):
-		print('STUB: ResourceManagerImpl.Preload path:' + path)
+		yagahost.PreloadAsset(path)
 		return ResourceHandle(path)
 	def Load(self, path):
 		if path.endswith('.evt'):
@@ -2,29 +2,100 @@
 import yagahost
 import yagascene
 
+# sounds shorter than that (in milliseconds) are decoded once and kept in memory,
+# the least recently played are discarded above the cache size
+SOUND_CACHE_MAX_LENGTH = 2000
+SOUND_CACHE_SIZE = 4 * 1024 * 1024
+
+yagahost.SetSoundCache(SOUND_CACHE_SIZE, SOUND_CACHE_MAX_LENGTH)
+
+# the sounds not recorded at the output rate are converted with a linear, 8 or 32 taps filter
+SOUND_RESAMPLER_QUALITY = yagahost.RESAMPLER_SINC_SHORT
+
+yagahost.SetResamplerQuality(SOUND_RESAMPLER_QUALITY)
+
 class ISound(object):
 	def __init__(self, res):
 		self.res = res
-		self.volume = 1.0
-		self.position = yagascene.Point(0.5)
+		self._volume = 1.0
+		self._position = yagascene.Point(0.5)
+		self._lipsync = False
+		# looped between the two times in seconds, 0 for the end of the sound
+		self.loop = False
+		self.loopStart = 0.0
+		self.loopEnd = 0.0
 		self._sound = -1
+		self._generation = 0
 	def __del__(self):
 		yagahost.StopAudio(self.res.f, self._sound)
 	def Run(self, scene):
 		# print('STUB: IAudio.Run res:' + str(self.res))
+		self._play(0.0, -1, 0)
+	def RunAt(self, scene, time):
+		# starts at the sample of the mixer clock, from SoundSystem().time
+		self._play(time, -1, 0)
+	def RunAfter(self, scene, sound):
+		# starts right after the last sample of the other sound, immediately if it is not playing
+		self._play(0.0, sound._sound, sound._generation)
+	def _play(self, start, after, after_generation):
 		yagahost.StopAudio(self.res.f, self._sound)
-		self._sound = yagahost.PlayAudio(self.res.f, self.res.path)
+		# the other sound is only followed if its channel has not been reused since
+		self._sound = yagahost.PlayAudio(self.res.f, self.res.path, start, after, self.loop, self.loopStart, self.loopEnd, self._volume, self._getpan(), after_generation)
+		self._generation = yagahost.GetAudioGeneration(self._sound)
+		self._update()
 	def Stop(self, scene):
 		# print('STUB: IAudio.Stop')
 		yagahost.StopAudio(self.res.f, self._sound)
 		self._sound = -1
+	def _update(self):
+		if self._sound >= 0:
+			yagahost.SetAudioVolume(self._sound, self._volume)
+			yagahost.SetAudioPan(self._sound, self._getpan())
+			yagahost.SetAudioLipsync(self._sound, self._lipsync)
+	def _getpan(self):
+		# the horizontal position goes from 0 (left) to 1 (right)
+		return self._position.x * 2 - 1
+	def getvolume(self):
+		return self._volume
+	def setvolume(self, volume):
+		self._volume = volume
+		self._update()
+	volume = property(getvolume, setvolume)
+	def getposition(self):
+		return self._position
+	def setposition(self, position):
+		self._position = position
+		self._update()
+	position = property(getposition, setposition)
 	def getisplaying(self):
 		return yagahost.IsAudioPlaying(self._sound)
 	isPlaying = property(getisplaying)
+	def gettime(self):
+		# seconds heard so far, from the audio clock
+		return yagahost.GetAudioPosition(self._sound)
+	time = property(gettime)
+	def getlipsync(self):
+		return self._lipsync
+	def setlipsync(self, lipsync):
+		self._lipsync = lipsync
+		self._update()
+	lipsync = property(getlipsync, setlipsync)
+	def getviseme(self):
+		# mouth shape estimated from the samples being heard
+		return yagahost.GetAudioViseme(self._sound)
+	viseme = property(getviseme)
 
 class SoundSystemImpl(object):
 	def __init__(self):
 		pass
+	def gettime(self):
+		# earliest time in seconds of the mixer clock a sound can be scheduled at with ISound.RunAt, heard after the latency
+		return yagahost.GetAudioTime()
+	time = property(gettime)
+	def getlatency(self):
+		# seconds between a sound scheduled at the time above and the moment it is heard
+		return yagahost.GetAudioLatency()
+	latency = property(getlatency)
 
 g_soundSystem = SoundSystemImpl()
 
@@ -1,5 +1,4 @@
 
-import random
 import yagaevents
 import yagagraphics
 import yagahost
@@ -123,8 +122,13 @@ class TalkieSpriteTalkies(object):
 		self.duration = 1.0
 		self.isPlaying = False
 		self._scene = None
+		self._chained = None
 	def Clear(self):
 		#print('STUB: TalkieSpriteTalkies.Clear')
+		# the next line is already queued in the mixer
+		if self._chained:
+			self._chained.Stop(self._scene)
+			self._chained = None
 		self.sounds.Clear()
 	def Stop(self, scene):
 		#print('STUB: TalkieSpriteTalkies.Stop')
@@ -133,20 +137,52 @@ class TalkieSpriteTalkies(object):
 	def Seek(self, timeOffset):
 		if not self.sounds.Empty():
 			if not self.sounds._queue[0].isPlaying:
-				self.sounds._queue.pop()
+				self.sounds._queue.pop(0)
 				if self.sounds.Empty():
 					self.isPlaying = False
 				else:
-					self.sounds._queue[0].Run(self._scene)
+					self._runSound(self._scene)
+	def gettime(self):
+		if self.sounds.Empty():
+			return 0.
+		return self.sounds._queue[0].time
+	time = property(gettime)
+	def getviseme(self):
+		if self.sounds.Empty():
+			return yagahost.VISEME_NONE
+		return self.sounds._queue[0].viseme
+	viseme = property(getviseme)
 	def Run(self, scene):
 		self._scene = scene
 		#print('STUB: TalkieSpriteTalkies.Run')
 		if not self.sounds.Empty():
-			self.sounds._queue[0].Run(scene)
+			self._runSound(scene)
 			self.isPlaying = True
+	def _runSound(self, scene):
+		sound = self.sounds._queue[0]
+		if sound is not self._chained:
+			sound.lipsync = True
+			sound.Run(scene)
+		# the next line is queued in the mixer, without gap after this one
+		self._chained = self.sounds[1]
+		if self._chained:
+			self._chained.lipsync = True
+			self._chained.RunAfter(scene, sound)
 
-RANDOM_PHONEME = True
+# the masks are estimated from the voices when the event stream has none, or always if set
+ESTIMATE_PHONEME = False
 PHONEMES = { 'A' : 2, 'EE' : 4, 'OH' : 8, 'U' : 16, 'D' : 32, 'M' : 128, 'TH' : 256, 'F' : 512, 'UH' : 1024 }
+VISEMES = {
+	yagahost.VISEME_A : PHONEMES['A'],
+	yagahost.VISEME_EE : PHONEMES['EE'],
+	yagahost.VISEME_OH : PHONEMES['OH'],
+	yagahost.VISEME_U : PHONEMES['U'],
+	yagahost.VISEME_D : PHONEMES['D'],
+	yagahost.VISEME_M : PHONEMES['M'],
+	yagahost.VISEME_TH : PHONEMES['TH'],
+	yagahost.VISEME_F : PHONEMES['F'],
+	yagahost.VISEME_UH : PHONEMES['UH']
+}
 
 class TalkieSprite(Sprite):
 	def __init__(self):
@@ -154,7 +190,6 @@ class TalkieSprite(Sprite):
 		self.talkies = TalkieSpriteTalkies()
 		self._talkieStream = None
 		self._time = 0
-		self._rnd = random.Random()
 	def AddChild(self, stream):
 		# print('STUB: TalkieSprite.AddChild stream:' + str(stream))
 		self._talkieStream = stream
@@ -168,11 +203,16 @@ class TalkieSprite(Sprite):
 		self._time += timeOffset
 		if self.talkies.isPlaying:
 			self.talkies.Seek(timeOffset)
-		if self._talkieStream:
-			if RANDOM_PHONEME:
-				self.renderMask = self._rnd.choice(PHONEMES.values())
-				return
-			mask = self._talkieStream.MaskData(int(self._time))
+		if self._talkieStream and self._talkieStream.HasMasks() and not ESTIMATE_PHONEME:
+			if self.talkies.isPlaying:
+				# the masks follow the voice instead of the frames count
+				mask = self._talkieStream.MaskDataAt(self.talkies.time)
+			else:
+				mask = self._talkieStream.MaskData(int(self._time))
+			if mask:
+				self.renderMask = mask
+		elif self.talkies.isPlaying:
+			mask = VISEMES.get(self.talkies.viseme)
 			if mask:
 				self.renderMask = mask
 
@@ -0,0 +1,67 @@
+
+#include "animation.h"
+#include "bakefile.h"
+#include "worker.h"
+#include "zipfile.h"
+
+static const char *USAGE =
+	"Usage: %s path/to/file.he...\n";
+
+static int is_animation(const char *name) {
+	const char *ext = name ? strrchr(name, '.') : 0;
+	return ext && (strcasecmp(ext + 1, "mng") == 0 || strcasecmp(ext + 1, "rle") == 0);
+}
+
+static int bake_archive(const char *path) {
+	struct zipfile_t *zf = Zipfile_Open(path);
+	if (!zf) {
+		return -1;
+	}
+	struct bakewriter_t *bw = Bakefile_Create(path);
+	if (!bw) {
+		Zipfile_Close(zf);
+		return -1;
+	}
+	int count = 0;
+	for (int i = 0; i < Zipfile_GetEntriesCount(zf); ++i) {
+		struct zipentry_t *ze = Zipfile_GetEntry(zf, i);
+		const char *name = Zipfile_GetEntryName(zf, ze);
+		if (!is_animation(name) || Zipfile_GetEntrySize(zf, ze) == 0) {
+			continue;
+		}
+		FILE *fp = Zipfile_OpenEntry(zf, ze);
+		if (!fp) {
+			continue;
+		}
+		const int anim = Animation_Load(fp, strrchr(name, '.') + 1, 0, ANIM_LOAD_BLOCKING);
+		fclose(fp);
+		if (!(anim < 0)) {
+			if (Bakefile_AddAnimation(bw, name, anim) == 0) {
+				++count;
+			}
+			Animation_Free(anim);
+		}
+	}
+	const int ret = Bakefile_Commit(bw);
+	Zipfile_Close(zf);
+	fprintf(stdout, "Baked %d animations from '%s'\n", count, path);
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stdout, USAGE, argv[0]);
+		return 0;
+	}
+	Worker_Init();
+	Animation_Init();
+	int ret = 0;
+	for (int i = 1; i < argc; ++i) {
+		if (bake_archive(argv[i]) < 0) {
+			ret = 1;
+		}
+	}
+	Animation_Fini();
+	Worker_Fini();
+	return ret;
+}
@@ -0,0 +1,69 @@
+
+#include "memory.h"
+#include "resampler.h"
+
+static const char *USAGE =
+	"Usage: %s [seconds]\n";
+
+#define OUTPUT_HZ 22050
+
+static const char *QUALITIES[] = { "linear", "sinc8", "sinc32" };
+
+static const int RATES[] = { 11025, 16000, 32000, 44100, 48000, 0 };
+
+/* the noise is generated once, the decoding cost is not measured */
+static int16_t _noise[RESAMPLER_INPUT_FRAMES * 2];
+
+static void init_noise() {
+	uint32_t seed = 1;
+	for (int i = 0; i < RESAMPLER_INPUT_FRAMES * 2; ++i) {
+		seed = seed * 1664525 + 1013904223;
+		_noise[i] = (int16_t)(seed >> 16);
+	}
+}
+
+static int read_source(void *param, int16_t *buffer, int count) {
+	const int channels = *(const int *)param;
+	memcpy(buffer, _noise, count * channels * sizeof(int16_t));
+	return count;
+}
+
+/* returns the microseconds spent to resample one second of a voice */
+static double bench_voice(int quality, int channels, int in_hz, int seconds) {
+	struct resampler_t r;
+	if (!Resampler_Init(&r, quality, channels, in_hz, OUTPUT_HZ)) {
+		return -1.;
+	}
+	/* the size of a block mixed by the audio callback */
+	int16_t out[256 * 2];
+	const int blocks_count = seconds * OUTPUT_HZ / 256;
+	const int64_t start = get_time_ns();
+	for (int i = 0; i < blocks_count; ++i) {
+		Resampler_Read(&r, out, 256, read_source, &channels);
+	}
+	return (get_time_ns() - start) / 1000. / seconds;
+}
+
+int main(int argc, char *argv[]) {
+	const int seconds = (argc > 1) ? atoi(argv[1]) : 60;
+	if (seconds <= 0) {
+		fprintf(stdout, USAGE, argv[0]);
+		return 0;
+	}
+	init_noise();
+	fprintf(stdout, "Microseconds to resample one second of a voice to %d Hz, %% of a core for 16 voices\n", OUTPUT_HZ);
+	fprintf(stdout, "%-8s %8s %6s %10s %7s\n", "quality", "channels", "hz", "us/s", "16v %");
+	for (int quality = RESAMPLER_LINEAR; quality <= RESAMPLER_SINC_LONG; ++quality) {
+		for (int channels = 1; channels <= 2; ++channels) {
+			for (int i = 0; RATES[i]; ++i) {
+				const double cost = bench_voice(quality, channels, RATES[i], seconds);
+				if (cost < 0) {
+					return 1;
+				}
+				fprintf(stdout, "%-8s %8d %6d %10.1f %7.2f\n", QUALITIES[quality], channels, RATES[i], cost, cost * 16 / 10000.);
+			}
+		}
+	}
+	Resampler_FreeTables();
+	return 0;
+}
@@ -2,7 +2,9 @@
 #include <Python.h>
 #include "animation.h"
 #include "font.h"
+#include "memory.h"
 #include "mixer.h"
+#include "resampler.h"
 #include "resource.h"
 #include "sys.h"
 #include "video.h"
@@ -53,6 +55,143 @@ static PyObject *yagahost_freeasset(PyObject *self, PyObject *args) {
 	Py_RETURN_NONE;
 }
 
+static PyObject *yagahost_isassetloaded(PyObject *self, PyObject *args) {
+	int num;
+
+	if (!PyArg_ParseTuple(args, "i", &num)) {
+		return 0;
+	}
+	/* -1 when the asset failed to load */
+	if (!(num < 0) && Resource_IsAnimationLoaded(num)) {
+		Py_RETURN_TRUE;
+	} else {
+		Py_RETURN_FALSE;
+	}
+}
+
+static PyObject *yagahost_setassetloadingmode(PyObject *self, PyObject *args) {
+	int mode;
+
+	if (!PyArg_ParseTuple(args, "i", &mode)) {
+		return 0;
+	}
+	Resource_SetLoadingMode(mode);
+	Py_RETURN_NONE;
+}
+
+static PyObject *yagahost_preloadasset(PyObject *self, PyObject *args) {
+	const char *path;
+
+	if (!PyArg_ParseTuple(args, "s", &path)) {
+		return 0;
+	}
+	Resource_Preload(path);
+	Py_RETURN_NONE;
+}
+
+static PyObject *yagahost_isassetpreloaded(PyObject *self, PyObject *args) {
+	const char *path;
+
+	if (!PyArg_ParseTuple(args, "s", &path)) {
+		return 0;
+	}
+	if (Resource_IsPreloaded(path)) {
+		Py_RETURN_TRUE;
+	} else {
+		Py_RETURN_FALSE;
+	}
+}
+
+static PyObject *yagahost_flushpreloadqueue(PyObject *self, PyObject *args) {
+	int wait;
+
+	if (!PyArg_ParseTuple(args, "i", &wait)) {
+		return 0;
+	}
+	Resource_FlushPreloadQueue(wait);
+	Py_RETURN_NONE;
+}
+
+static PyObject *yagahost_setassettracecontext(PyObject *self, PyObject *args) {
+	const char *name;
+
+	if (!PyArg_ParseTuple(args, "s", &name)) {
+		return 0;
+	}
+	Resource_SetTraceContext(name);
+	Py_RETURN_NONE;
+}
+
+static PyObject *yagahost_getassetstats(PyObject *self, PyObject *args) {
+	const char *path;
+
+	if (!PyArg_ParseTuple(args, "s", &path)) {
+		return 0;
+	}
+	const struct anim_stats_t *stats = Resource_GetAnimationStats(path);
+	if (stats) {
+		PyObject *obj = PyDict_New();
+		PyDict_SetItemString(obj, "loads", PyInt_FromLong(stats->loads_count));
+		PyDict_SetItemString(obj, "hits", PyInt_FromLong(stats->hits_count));
+		PyDict_SetItemString(obj, "bytesRead", PyInt_FromLong(stats->bytes_read));
+		PyDict_SetItemString(obj, "lookupTime", PyInt_FromLong(stats->lookup_time));
+		PyDict_SetItemString(obj, "parseTime", PyInt_FromLong(stats->parse_time));
+		PyDict_SetItemString(obj, "inflateTime", PyInt_FromLong(stats->inflate_time));
+		PyDict_SetItemString(obj, "convertTime", PyInt_FromLong(stats->convert_time));
+		PyDict_SetItemString(obj, "residentBytes", PyInt_FromLong(stats->resident_size));
+		PyDict_SetItemString(obj, "frames", PyInt_FromLong(stats->frames_count));
+		PyDict_SetItemString(obj, "layers", PyInt_FromLong(stats->layers_count));
+		return obj;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *yagahost_setassetcachesize(PyObject *self, PyObject *args) {
+	int size;
+
+	if (!PyArg_ParseTuple(args, "i", &size)) {
+		return 0;
+	}
+	Animation_SetCacheSize(size);
+	Py_RETURN_NONE;
+}
+
+static PyObject *yagahost_getmemorystats(PyObject *self, PyObject *args) {
+	PyObject *obj = PyDict_New();
+	PyDict_SetItemString(obj, "layers", PyLong_FromLongLong(Memory_GetUsed(MEMORY_LAYERS)));
+	PyDict_SetItemString(obj, "zipfiles", PyLong_FromLongLong(Memory_GetUsed(MEMORY_ZIPFILES)));
+	PyDict_SetItemString(obj, "audio", PyLong_FromLongLong(Memory_GetUsed(MEMORY_AUDIO)));
+	PyDict_SetItemString(obj, "video", PyLong_FromLongLong(Memory_GetUsed(MEMORY_VIDEO)));
+	PyDict_SetItemString(obj, "images", PyLong_FromLongLong(Memory_GetUsed(MEMORY_IMAGES)));
+	PyDict_SetItemString(obj, "total", PyLong_FromLongLong(Memory_GetUsed(MEMORY_TOTAL)));
+	PyDict_SetItemString(obj, "cached", PyInt_FromLong(Animation_GetCachedSize()));
+	return obj;
+}
+
+static PyObject *yagahost_setmemorybudget(PyObject *self, PyObject *args) {
+	int category;
+	PY_LONG_LONG size;
+
+	if (!PyArg_ParseTuple(args, "iL", &category, &size)) {
+		return 0;
+	}
+	if (category < 0 || category > MEMORY_TOTAL) {
+		fprintf(stderr, "Invalid memory category %d\n", category);
+	} else {
+		Memory_SetBudget(category, size);
+		Animation_TrimCache();
+		Mixer_TrimCache();
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *yagahost_getsystemmemory(PyObject *self, PyObject *args) {
+	int64_t total, avail;
+
+	Memory_GetSystemInfo(&total, &avail);
+	return Py_BuildValue("(LL)", (PY_LONG_LONG)total, (PY_LONG_LONG)avail);
+}
+
 static PyObject *yagahost_openasset(PyObject *self, PyObject *args) {
 	const char *path;
 
@@ -84,7 +223,8 @@ static PyObject *yagahost_setscreensize(PyObject *self, PyObject *args) {
 		return 0;
 	}
 	System_SetScreenSize(w, h);
-	_screenBuffer = (uint32_t *)malloc(w * h * sizeof(uint32_t));
+	Memory_Free(MEMORY_IMAGES, _screenBuffer);
+	_screenBuffer = (uint32_t *)Memory_Alloc(MEMORY_IMAGES, w * h * sizeof(uint32_t));
 	_screenW = w;
 	_screenH = h;
 	Py_RETURN_NONE;
@@ -239,29 +379,43 @@ static PyObject *yagahost_enableanimationframelayer(PyObject *self, PyObject *ar
 
 static const struct {
 	const char *ext;
-	int (*play)(FILE *);
+	int (*play)(FILE *, const char *, const struct mixer_play_t *);
 } _audioFormats[] = {
 	{ "mp3", &Mixer_PlayMp3 },
 	{ "wav", &Mixer_PlayWav },
 	{ 0, 0 }
 };
 
+/* the times are in seconds, start as returned by GetAudioTime, after the sound to follow, volume and pan as SetAudioVolume and SetAudioPan, generation of the sound to follow as returned by GetAudioGeneration */
 static PyObject *yagahost_playaudio(PyObject *self, PyObject *args) {
 	int sound = -1;
 	PyObject *file;
 	const char *name;
+	double start = 0., loop_start = 0., loop_end = 0.;
+	int after = -1, loop = 0, after_generation = 0;
+	float volume = 1.f, pan = 0.f;
 
-	if (!PyArg_ParseTuple(args, "Os", &file, &name)) {
+	if (!PyArg_ParseTuple(args, "Os|diiddffi", &file, &name, &start, &after, &loop, &loop_start, &loop_end, &volume, &pan, &after_generation)) {
 		return 0;
 	}
 	assert(PyFile_CheckExact(file));
+	const int rate = Mixer_GetRate();
+	struct mixer_play_t play;
+	play.start = (start > 0.) ? llrint(start * rate) : 0;
+	play.after = after;
+	play.after_generation = (uint32_t)after_generation;
+	play.loop = loop;
+	play.loop_start = (loop_start > 0.) ? lrint(loop_start * rate) : 0;
+	play.loop_end = (loop_end > 0.) ? lrint(loop_end * rate) : 0;
+	play.volume = volume;
+	play.pan = pan;
 	const char *ext = strrchr(name, '.');
 	if (ext) {
 		++ext;
 		for (int i = 0; _audioFormats[i].ext; ++i) {
 			if (strcasecmp(_audioFormats[i].ext, ext) == 0) {
 				PyFile_IncUseCount((PyFileObject *)file);
-				sound = (_audioFormats[i].play)(PyFile_AsFile(file));
+				sound = (_audioFormats[i].play)(PyFile_AsFile(file), name, &play);
 				break;
 			}
 		}
@@ -299,6 +453,125 @@ static PyObject *yagahost_isaudioplaying(PyObject *self, PyObject *args) {
 	Py_RETURN_FALSE;
 }
 
+/* seconds played, following the audio clock */
+static PyObject *yagahost_getaudioposition(PyObject *self, PyObject *args) {
+	int sound;
+	double position = 0.;
+
+	if (!PyArg_ParseTuple(args, "i", &sound)) {
+		return 0;
+	}
+	if (!(sound < 0)) {
+		position = Mixer_GetPosition(sound) / (double)Mixer_GetRate();
+	}
+	return PyFloat_FromDouble(position);
+}
+
+static PyObject *yagahost_getaudiogeneration(PyObject *self, PyObject *args) {
+	int sound;
+
+	if (!PyArg_ParseTuple(args, "i", &sound)) {
+		return 0;
+	}
+	if (sound < 0) {
+		return PyInt_FromLong(0);
+	}
+	return PyInt_FromLong((int)Mixer_GetGeneration(sound));
+}
+
+static PyObject *yagahost_getaudiotime(PyObject *self, PyObject *args) {
+	return PyFloat_FromDouble(Mixer_GetTime() / (double)Mixer_GetRate());
+}
+
+static PyObject *yagahost_getaudiolatency(PyObject *self, PyObject *args) {
+	return PyFloat_FromDouble(Mixer_GetLatency() / (double)Mixer_GetRate());
+}
+
+static PyObject *yagahost_setaudiolipsync(PyObject *self, PyObject *args) {
+	int sound, flag;
+
+	if (!PyArg_ParseTuple(args, "ii", &sound, &flag)) {
+		return 0;
+	}
+	if (!(sound < 0)) {
+		Mixer_SetLipsync(sound, flag);
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *yagahost_getaudioviseme(PyObject *self, PyObject *args) {
+	int sound;
+	int viseme = VISEME_NONE;
+
+	if (!PyArg_ParseTuple(args, "i", &sound)) {
+		return 0;
+	}
+	if (!(sound < 0)) {
+		viseme = Mixer_GetViseme(sound);
+	}
+	return PyInt_FromLong(viseme);
+}
+
+static PyObject *yagahost_setaudiovolume(PyObject *self, PyObject *args) {
+	int sound;
+	float volume;
+
+	if (!PyArg_ParseTuple(args, "if", &sound, &volume)) {
+		return 0;
+	}
+	if (!(sound < 0)) {
+		Mixer_SetVolume(sound, volume);
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *yagahost_setaudiopan(PyObject *self, PyObject *args) {
+	int sound;
+	float pan;
+
+	if (!PyArg_ParseTuple(args, "if", &sound, &pan)) {
+		return 0;
+	}
+	if (!(sound < 0)) {
+		Mixer_SetPan(sound, pan);
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *yagahost_setsoundcache(PyObject *self, PyObject *args) {
+	int size, max_length;
+
+	if (!PyArg_ParseTuple(args, "ii", &size, &max_length)) {
+		return 0;
+	}
+	Mixer_SetSoundCache(size, max_length);
+	Py_RETURN_NONE;
+}
+
+static PyObject *yagahost_setresamplerquality(PyObject *self, PyObject *args) {
+	int quality;
+
+	if (!PyArg_ParseTuple(args, "i", &quality)) {
+		return 0;
+	}
+	Mixer_SetResamplerQuality(quality);
+	Py_RETURN_NONE;
+}
+
+static PyObject *yagahost_getaudiostats(PyObject *self, PyObject *args) {
+	struct mixer_stats_t stats;
+	Mixer_GetStats(&stats);
+	PyObject *obj = PyDict_New();
+	PyDict_SetItemString(obj, "callbacks", PyInt_FromLong(stats.callbacks));
+	PyDict_SetItemString(obj, "interval_avg", PyInt_FromLong(stats.interval_avg));
+	PyDict_SetItemString(obj, "interval_max", PyInt_FromLong(stats.interval_max));
+	PyDict_SetItemString(obj, "duration_avg", PyInt_FromLong(stats.duration_avg));
+	PyDict_SetItemString(obj, "duration_max", PyInt_FromLong(stats.duration_max));
+	PyDict_SetItemString(obj, "underruns", PyInt_FromLong(stats.underruns));
+	PyDict_SetItemString(obj, "starved", PyInt_FromLong(stats.starved));
+	return obj;
+}
+
 static PyObject *yagahost_pollevent(PyObject *self, PyObject *args) {
 	struct event_t ev;
 	if (System_PollEvent(&ev)) {
@@ -341,7 +614,7 @@ static PyObject *yagahost_loadcursor(PyObject *self, PyObject *args) {
 	} else {
 		const char *sep = strrchr(name, '.');
 		if (sep) {
-			const int anim = Animation_Load(fp, sep + 1);
+			const int anim = Animation_Load(fp, sep + 1, 0, ANIM_LOAD_BLOCKING);
 			if (!(anim < 0)) {
 				struct layer_t *layer = Animation_GetLayer(anim, 0, 0);
 				if (layer) {
@@ -470,6 +743,17 @@ static PyMethodDef yagahost_methods[] = {
 	{ "HasAsset", yagahost_hasasset, METH_VARARGS, "" },
 	{ "LoadAsset", yagahost_loadasset, METH_VARARGS, "" },
 	{ "FreeAsset", yagahost_freeasset, METH_VARARGS, "" },
+	{ "IsAssetLoaded", yagahost_isassetloaded, METH_VARARGS, "" },
+	{ "SetAssetLoadingMode", yagahost_setassetloadingmode, METH_VARARGS, "" },
+	{ "SetAssetCacheSize", yagahost_setassetcachesize, METH_VARARGS, "" },
+	{ "GetAssetStats", yagahost_getassetstats, METH_VARARGS, "" },
+	{ "PreloadAsset", yagahost_preloadasset, METH_VARARGS, "" },
+	{ "IsAssetPreloaded", yagahost_isassetpreloaded, METH_VARARGS, "" },
+	{ "FlushPreloadQueue", yagahost_flushpreloadqueue, METH_VARARGS, "" },
+	{ "SetAssetTraceContext", yagahost_setassettracecontext, METH_VARARGS, "" },
+	{ "GetMemoryStats", yagahost_getmemorystats, METH_VARARGS, "" },
+	{ "SetMemoryBudget", yagahost_setmemorybudget, METH_VARARGS, "" },
+	{ "GetSystemMemory", yagahost_getsystemmemory, METH_VARARGS, "" },
 	{ "OpenAsset", yagahost_openasset, METH_VARARGS, "" },
 	{ "SetScreenWindowed", yagahost_setscreenwindowed, METH_VARARGS, "" },
 	{ "SetScreenSize", yagahost_setscreensize, METH_VARARGS, "" },
@@ -486,6 +770,17 @@ static PyMethodDef yagahost_methods[] = {
 	{ "PlayAudio", yagahost_playaudio, METH_VARARGS, "" },
 	{ "StopAudio", yagahost_stopaudio, METH_VARARGS, "" },
 	{ "IsAudioPlaying", yagahost_isaudioplaying, METH_VARARGS, "" },
+	{ "GetAudioPosition", yagahost_getaudioposition, METH_VARARGS, "" },
+	{ "GetAudioTime", yagahost_getaudiotime, METH_VARARGS, "" },
+	{ "GetAudioGeneration", yagahost_getaudiogeneration, METH_VARARGS, "" },
+	{ "GetAudioLatency", yagahost_getaudiolatency, METH_VARARGS, "" },
+	{ "SetAudioLipsync", yagahost_setaudiolipsync, METH_VARARGS, "" },
+	{ "GetAudioViseme", yagahost_getaudioviseme, METH_VARARGS, "" },
+	{ "SetAudioVolume", yagahost_setaudiovolume, METH_VARARGS, "" },
+	{ "SetAudioPan", yagahost_setaudiopan, METH_VARARGS, "" },
+	{ "SetSoundCache", yagahost_setsoundcache, METH_VARARGS, "" },
+	{ "SetResamplerQuality", yagahost_setresamplerquality, METH_VARARGS, "" },
+	{ "GetAudioStats", yagahost_getaudiostats, METH_VARARGS, "" },
 	{ "PollEvent", yagahost_pollevent, METH_VARARGS, "" },
 	{ "LoadCursor", yagahost_loadcursor, METH_VARARGS, "" },
 	{ "SetCursor", yagahost_setcursor, METH_VARARGS, "" },
@@ -513,6 +808,56 @@ static const struct {
 	{ 0, 0 }
 };
 
+static const struct {
+	char *name;
+	int value;
+} _loadingModes[] = {
+	{ "ASSET_LOAD_BLOCKING", ANIM_LOAD_BLOCKING },
+	{ "ASSET_LOAD_PROGRESSIVE", ANIM_LOAD_PROGRESSIVE },
+	{ "ASSET_LOAD_PROGRESSIVE_SKIP", ANIM_LOAD_PROGRESSIVE_SKIP },
+	{ 0, 0 }
+};
+
+static const struct {
+	char *name;
+	int value;
+} _memoryCategories[] = {
+	{ "MEMORY_LAYERS", MEMORY_LAYERS },
+	{ "MEMORY_ZIPFILES", MEMORY_ZIPFILES },
+	{ "MEMORY_AUDIO", MEMORY_AUDIO },
+	{ "MEMORY_VIDEO", MEMORY_VIDEO },
+	{ "MEMORY_IMAGES", MEMORY_IMAGES },
+	{ "MEMORY_TOTAL", MEMORY_TOTAL },
+	{ 0, 0 }
+};
+
+static const struct {
+	char *name;
+	int value;
+} _resamplerQualities[] = {
+	{ "RESAMPLER_LINEAR", RESAMPLER_LINEAR },
+	{ "RESAMPLER_SINC_SHORT", RESAMPLER_SINC_SHORT },
+	{ "RESAMPLER_SINC_LONG", RESAMPLER_SINC_LONG },
+	{ 0, 0 }
+};
+
+static const struct {
+	char *name;
+	int value;
+} _visemes[] = {
+	{ "VISEME_NONE", VISEME_NONE },
+	{ "VISEME_A", VISEME_A },
+	{ "VISEME_EE", VISEME_EE },
+	{ "VISEME_OH", VISEME_OH },
+	{ "VISEME_U", VISEME_U },
+	{ "VISEME_D", VISEME_D },
+	{ "VISEME_M", VISEME_M },
+	{ "VISEME_TH", VISEME_TH },
+	{ "VISEME_F", VISEME_F },
+	{ "VISEME_UH", VISEME_UH },
+	{ 0, 0 }
+};
+
 static const struct {
 	char *name;
 	int value;
@@ -566,4 +911,16 @@ void inityagahost(void) { // PyMODINIT_FUNC
 	for (int i = 0; _keys[i].name; ++i) {
 		PyModule_AddIntConstant(m, _keys[i].name, _keys[i].value);
 	}
+	for (int i = 0; _loadingModes[i].name; ++i) {
+		PyModule_AddIntConstant(m, _loadingModes[i].name, _loadingModes[i].value);
+	}
+	for (int i = 0; _memoryCategories[i].name; ++i) {
+		PyModule_AddIntConstant(m, _memoryCategories[i].name, _memoryCategories[i].value);
+	}
+	for (int i = 0; _resamplerQualities[i].name; ++i) {
+		PyModule_AddIntConstant(m, _resamplerQualities[i].name, _resamplerQualities[i].value);
+	}
+	for (int i = 0; _visemes[i].name; ++i) {
+		PyModule_AddIntConstant(m, _visemes[i].name, _visemes[i].value);
+	}
 }
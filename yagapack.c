@@ -0,0 +1,415 @@
+
+#include <ctype.h>
+#include <sys/param.h>
+#include <unistd.h>
+#include "zipfile.h"
+
+static const char *USAGE =
+	"Usage: %s [-t traces] [-x layout.xml]... input.he output.he\n";
+
+#define MAX_CONTEXTS 1024
+
+struct pack_entry_t {
+	const char *name;
+	struct zipentry_raw_t raw;
+	int cluster; /* -1 if never referenced */
+	int rank;
+};
+
+struct sequence_t {
+	int *entries;
+	int count;
+};
+
+static struct pack_entry_t *_entries;
+static int _entries_count;
+static char *_contexts[MAX_CONTEXTS];
+static int _contexts_count;
+static int _rank;
+static struct sequence_t *_sequences;
+static int _sequences_count;
+
+static int compare_name(const void *a, const void *b) {
+	return strcasecmp((const char *)a, ((const struct pack_entry_t *)b)->name);
+}
+
+static int find_entry(const char *name) {
+	const struct pack_entry_t *entry = (const struct pack_entry_t *)bsearch(name, _entries, _entries_count, sizeof(struct pack_entry_t), compare_name);
+	return entry ? entry - _entries : -1;
+}
+
+static int get_context(const char *name) {
+	for (int i = 0; i < _contexts_count; ++i) {
+		if (strcmp(_contexts[i], name) == 0) {
+			return i;
+		}
+	}
+	if (_contexts_count == MAX_CONTEXTS) {
+		return MAX_CONTEXTS - 1;
+	}
+	_contexts[_contexts_count] = strdup(name);
+	return _contexts_count++;
+}
+
+/* entries are grouped by the context of their first reference, in the order of that reference */
+static void add_reference(int num, const char *context) {
+	struct pack_entry_t *entry = &_entries[num];
+	if (entry->cluster < 0) {
+		entry->cluster = get_context(context);
+		entry->rank = _rank++;
+	}
+}
+
+static struct sequence_t *add_sequence() {
+	struct sequence_t *sequences = (struct sequence_t *)realloc(_sequences, (_sequences_count + 1) * sizeof(struct sequence_t));
+	if (!sequences) {
+		return 0;
+	}
+	_sequences = sequences;
+	struct sequence_t *seq = &_sequences[_sequences_count++];
+	seq->entries = 0;
+	seq->count = 0;
+	return seq;
+}
+
+static void add_access(struct sequence_t *seq, int num) {
+	int *entries = (int *)realloc(seq->entries, (seq->count + 1) * sizeof(int));
+	if (entries) {
+		seq->entries = entries;
+		seq->entries[seq->count++] = num;
+	}
+}
+
+/* traces are recorded with the TRACEFILE environment variable, the paths are prefixed with the archive name */
+static void load_traces(const char *path, const char *stem) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "Failed to open '%s'\n", path);
+		return;
+	}
+	const int len = strlen(stem);
+	struct sequence_t *seq = 0;
+	char line[MAXPATHLEN + 128];
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (strncmp(line, "session", 7) == 0) {
+			seq = 0;
+			continue;
+		}
+		char *context = strchr(line, '\t');
+		if (!context) {
+			continue;
+		}
+		*context++ = 0;
+		char *key = strchr(context, '\t');
+		if (!key) {
+			continue;
+		}
+		*key++ = 0;
+		if (strncmp(key, stem, len) != 0 || key[len] != '/') {
+			continue;
+		}
+		const int num = find_entry(key + len + 1);
+		if (num < 0) {
+			continue;
+		}
+		if (!seq) {
+			seq = add_sequence();
+			if (!seq) {
+				break;
+			}
+		}
+		add_reference(num, context);
+		add_access(seq, num);
+	}
+	fclose(fp);
+}
+
+struct layout_ref_t {
+	int num;
+	int pos;
+};
+
+static int compare_layout_ref(const void *a, const void *b) {
+	return ((const struct layout_ref_t *)a)->pos - ((const struct layout_ref_t *)b)->pos;
+}
+
+/* the entries referenced in a layout file are ordered by their first occurrence */
+static void load_layout(const char *path, bool measure) {
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		fprintf(stderr, "Failed to open '%s'\n", path);
+		return;
+	}
+	fseek(fp, 0, SEEK_END);
+	const int size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	char *buf = (char *)malloc(size + 1);
+	struct layout_ref_t *refs = (struct layout_ref_t *)malloc(_entries_count * sizeof(struct layout_ref_t));
+	if (buf && refs && fread(buf, 1, size, fp) == size) {
+		buf[size] = 0;
+		int count = 0;
+		for (int i = 0; i < _entries_count; ++i) {
+			const char *name = _entries[i].name;
+			const char *p = strcasestr(buf, name);
+			if (!p) {
+				const char *sep = strrchr(name, '/');
+				if (sep && sep[1]) {
+					p = strcasestr(buf, sep + 1);
+				}
+			}
+			if (p) {
+				refs[count].num = i;
+				refs[count].pos = p - buf;
+				++count;
+			}
+		}
+		qsort(refs, count, sizeof(struct layout_ref_t), compare_layout_ref);
+		/* without traces, the layout order is used to measure the seeks */
+		struct sequence_t *seq = measure ? add_sequence() : 0;
+		for (int i = 0; i < count; ++i) {
+			add_reference(refs[i].num, path);
+			if (seq) {
+				add_access(seq, refs[i].num);
+			}
+		}
+	}
+	free(refs);
+	free(buf);
+	fclose(fp);
+}
+
+static int compare_pack_entry(const void *a, const void *b) {
+	const struct pack_entry_t *e1 = *(const struct pack_entry_t **)a;
+	const struct pack_entry_t *e2 = *(const struct pack_entry_t **)b;
+	if (e1->cluster != e2->cluster) {
+		if (e1->cluster < 0) {
+			return 1;
+		}
+		if (e2->cluster < 0) {
+			return -1;
+		}
+		return e1->cluster - e2->cluster;
+	}
+	if (e1->cluster < 0) {
+		/* unreferenced entries keep their original order */
+		return (e1->raw.offset > e2->raw.offset) - (e1->raw.offset < e2->raw.offset);
+	}
+	return e1->rank - e2->rank;
+}
+
+static void fwrite_le16(FILE *fp, uint16_t value) {
+	uint8_t buf[2];
+	TO_LE16(buf, value);
+	fwrite(buf, 1, sizeof(buf), fp);
+}
+
+static void fwrite_le32(FILE *fp, uint32_t value) {
+	uint8_t buf[4];
+	TO_LE32(buf, value);
+	fwrite(buf, 1, sizeof(buf), fp);
+}
+
+static void write_entry_header(FILE *fp, const struct pack_entry_t *entry) {
+	fwrite_le16(fp, 20); /* version needed for extraction */
+	fwrite_le16(fp, 0); /* flags */
+	fwrite_le16(fp, entry->raw.compression);
+	fwrite_le32(fp, entry->raw.dostime);
+	fwrite_le32(fp, entry->raw.crc);
+	fwrite_le32(fp, entry->raw.compressed_size);
+	fwrite_le32(fp, entry->raw.size);
+	fwrite_le16(fp, strlen(entry->name));
+	fwrite_le16(fp, 0); /* extra field length */
+}
+
+static int write_archive(const char *path, struct pack_entry_t **order) {
+	char tmp_path[MAXPATHLEN];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	FILE *fp = fopen(tmp_path, "wb");
+	if (!fp) {
+		fprintf(stderr, "Failed to open '%s'\n", tmp_path);
+		return -1;
+	}
+	uint32_t *offsets = (uint32_t *)malloc(_entries_count * sizeof(uint32_t));
+	if (!offsets) {
+		fclose(fp);
+		unlink(tmp_path);
+		return -1;
+	}
+	for (int i = 0; i < _entries_count; ++i) {
+		const struct pack_entry_t *entry = order[i];
+		offsets[i] = ftell(fp);
+		fwrite_le32(fp, 0x04034B50);
+		write_entry_header(fp, entry);
+		fwrite(entry->name, 1, strlen(entry->name), fp);
+		fwrite(entry->raw.data, 1, entry->raw.compressed_size, fp);
+	}
+	const uint32_t directory_offset = ftell(fp);
+	for (int i = 0; i < _entries_count; ++i) {
+		const struct pack_entry_t *entry = order[i];
+		fwrite_le32(fp, 0x02014B50);
+		fwrite_le16(fp, 20); /* version made by */
+		write_entry_header(fp, entry);
+		fwrite_le16(fp, 0); /* comment length */
+		fwrite_le16(fp, 0); /* disk number */
+		fwrite_le16(fp, 0); /* internal attributes */
+		fwrite_le32(fp, 0); /* external attributes */
+		fwrite_le32(fp, offsets[i]);
+		fwrite(entry->name, 1, strlen(entry->name), fp);
+	}
+	const uint32_t directory_size = ftell(fp) - directory_offset;
+	fwrite_le32(fp, 0x06054B50);
+	fwrite_le16(fp, 0); /* disk number */
+	fwrite_le16(fp, 0); /* central directory disk number */
+	fwrite_le16(fp, _entries_count);
+	fwrite_le16(fp, _entries_count);
+	fwrite_le32(fp, directory_size);
+	fwrite_le32(fp, directory_offset);
+	fwrite_le16(fp, 0); /* comment length */
+	free(offsets);
+	const int err = ferror(fp);
+	fclose(fp);
+	if (err || rename(tmp_path, path) != 0) {
+		fprintf(stderr, "Failed to write '%s'\n", path);
+		unlink(tmp_path);
+		return -1;
+	}
+	return 0;
+}
+
+/* distance between the end of an entry and the start of the next one read */
+static uint64_t get_seek_distance(const uint32_t *offsets) {
+	uint64_t distance = 0;
+	for (int i = 0; i < _sequences_count; ++i) {
+		int64_t pos = -1;
+		for (int j = 0; j < _sequences[i].count; ++j) {
+			const struct pack_entry_t *entry = &_entries[_sequences[i].entries[j]];
+			const int64_t start = offsets[_sequences[i].entries[j]];
+			if (!(pos < 0)) {
+				distance += (start > pos) ? start - pos : pos - start;
+			}
+			pos = start + 30 + strlen(entry->name) + entry->raw.compressed_size;
+		}
+	}
+	return distance;
+}
+
+static void get_stem(const char *path, char *buf, int size) {
+	const char *sep = strrchr(path, '/');
+	snprintf(buf, size, "%s", sep ? sep + 1 : path);
+	char *ext = strrchr(buf, '.');
+	if (ext) {
+		*ext = 0;
+	}
+	for (; *buf; ++buf) {
+		*buf = tolower((uint8_t)*buf);
+	}
+}
+
+static int pack_archive(const char *input, const char *output, const char *traces, const char **layouts, int layouts_count) {
+	struct zipfile_t *zf = Zipfile_Open(input);
+	if (!zf) {
+		return -1;
+	}
+	/* the entries skipped by the index would be missing from the packed archive */
+	if (Zipfile_GetEntriesCount(zf) != Zipfile_GetDirectoryCount(zf)) {
+		fprintf(stderr, "Failed to pack '%s', %d of %d entries are not handled\n", input, Zipfile_GetDirectoryCount(zf) - Zipfile_GetEntriesCount(zf), Zipfile_GetDirectoryCount(zf));
+		Zipfile_Close(zf);
+		return -1;
+	}
+	/* the entries are sorted by name */
+	_entries_count = Zipfile_GetEntriesCount(zf);
+	_entries = (struct pack_entry_t *)calloc(_entries_count, sizeof(struct pack_entry_t));
+	struct pack_entry_t **order = (struct pack_entry_t **)malloc(_entries_count * sizeof(struct pack_entry_t *));
+	uint32_t *offsets = (uint32_t *)malloc(_entries_count * sizeof(uint32_t));
+	if (!_entries || !order || !offsets) {
+		free(_entries);
+		free(order);
+		free(offsets);
+		Zipfile_Close(zf);
+		return -1;
+	}
+	for (int i = 0; i < _entries_count; ++i) {
+		struct zipentry_t *ze = Zipfile_GetEntry(zf, i);
+		_entries[i].name = Zipfile_GetEntryName(zf, ze);
+		Zipfile_GetEntryRaw(zf, ze, &_entries[i].raw);
+		_entries[i].cluster = -1;
+		order[i] = &_entries[i];
+		offsets[i] = _entries[i].raw.offset;
+	}
+	if (traces) {
+		char stem[MAXPATHLEN];
+		get_stem(input, stem, sizeof(stem));
+		load_traces(traces, stem);
+	}
+	const bool measure = (_sequences_count == 0);
+	for (int i = 0; i < layouts_count; ++i) {
+		load_layout(layouts[i], measure);
+	}
+	const uint64_t distance_before = get_seek_distance(offsets);
+	qsort(order, _entries_count, sizeof(struct pack_entry_t *), compare_pack_entry);
+	int ret = write_archive(output, order);
+	if (ret == 0) {
+		struct zipfile_t *packed = Zipfile_Open(output);
+		if (!packed || Zipfile_GetEntriesCount(packed) != _entries_count) {
+			fprintf(stderr, "Failed to read back '%s'\n", output);
+			ret = -1;
+		} else {
+			for (int i = 0; i < _entries_count; ++i) {
+				struct zipentry_raw_t raw;
+				Zipfile_GetEntryRaw(packed, Zipfile_GetEntry(packed, i), &raw);
+				offsets[i] = raw.offset;
+			}
+			int count = 0;
+			for (int i = 0; i < _entries_count; ++i) {
+				if (!(_entries[i].cluster < 0)) {
+					++count;
+				}
+			}
+			fprintf(stdout, "Ordered %d of %d entries from %d contexts\n", count, _entries_count, _contexts_count);
+			fprintf(stdout, "Seek distance %d KB before, %d KB after\n", (int)(distance_before / 1024), (int)(get_seek_distance(offsets) / 1024));
+		}
+		if (packed) {
+			Zipfile_Close(packed);
+		}
+	}
+	for (int i = 0; i < _sequences_count; ++i) {
+		free(_sequences[i].entries);
+	}
+	free(_sequences);
+	_sequences = 0;
+	_sequences_count = 0;
+	for (int i = 0; i < _contexts_count; ++i) {
+		free(_contexts[i]);
+	}
+	_contexts_count = 0;
+	free(offsets);
+	free(order);
+	free(_entries);
+	_entries = 0;
+	Zipfile_Close(zf);
+	return ret;
+}
+
+#define MAX_LAYOUTS 64
+
+int main(int argc, char *argv[]) {
+	const char *traces = 0;
+	const char *layouts[MAX_LAYOUTS];
+	int layouts_count = 0;
+	int i = 1;
+	for (; i < argc - 1; i += 2) {
+		if (strcmp(argv[i], "-t") == 0) {
+			traces = argv[i + 1];
+		} else if (strcmp(argv[i], "-x") == 0 && layouts_count < MAX_LAYOUTS) {
+			layouts[layouts_count++] = argv[i + 1];
+		} else {
+			break;
+		}
+	}
+	if (argc - i != 2) {
+		fprintf(stdout, USAGE, argv[0]);
+		return 0;
+	}
+	return pack_archive(argv[i], argv[i + 1], traces, layouts, layouts_count) < 0 ? 1 : 0;
+}
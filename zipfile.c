@@ -1,126 +1,355 @@
 
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "memory.h"
 #include "zipfile.h"
 
+enum {
+	COMPRESSION_STORED = 0,
+	COMPRESSION_DEFLATE = 8
+};
+
 struct zipentry_t {
 	char *name;
-	uint32_t offset;
+	uint32_t offset; /* local file header */
 	uint32_t size;
-	uint8_t *buffer;
-	uint32_t buffer_offset;
+	uint32_t compressed_size;
+	uint32_t crc;
+	uint32_t dostime;
+	uint16_t compression;
 };
 
 struct zipfile_t {
-	FILE *fp;
+	atomic_int refs; /* the mapping is shared with the opened entries */
+	uint8_t *data;
+	size_t size;
+	char *names;
 	struct zipentry_t *entries;
 	int entries_count;
+	int directory_count; /* including the entries not handled */
 };
 
 static int compare_zipentry(const void *a, const void *b) {
 	return strcasecmp(((const struct zipentry_t *)a)->name, ((const struct zipentry_t *)b)->name);
 }
 
-struct zipfile_t *Zipfile_Open(const char *name) {
-	FILE *fp = fopen(name, "rb");
-	if (!fp) {
+static uint8_t *map_file(const char *name, size_t *size) {
+	const int fd = open(name, O_RDONLY);
+	if (fd < 0) {
 		fprintf(stderr, "Failed to open '%s'\n", name);
 		return 0;
 	}
+	uint8_t *data = 0;
+	struct stat st;
+	if (fstat(fd, &st) == 0) {
+		void *p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) {
+			fprintf(stderr, "Failed to map '%s'\n", name);
+		} else {
+			/* entries are looked up in any order */
+			madvise(p, st.st_size, MADV_RANDOM);
+			data = (uint8_t *)p;
+			*size = st.st_size;
+		}
+	}
+	close(fd);
+	return data;
+}
+
+struct zipfile_t *Zipfile_Open(const char *name) {
+	size_t size;
+	uint8_t *data = map_file(name, &size);
+	if (!data) {
+		return 0;
+	}
 	static const int EOD_SIZE = 22; /* 'end of central directory record' without comment */
-	fseek(fp, -EOD_SIZE, SEEK_END);
-	const uint32_t eod_signature = fread_le32(fp);
+	assert(size >= EOD_SIZE);
+	const uint8_t *p = data + size - EOD_SIZE;
+	const uint32_t eod_signature = READ_LE_UINT32(p);
 	assert(eod_signature == 0x06054B50);
-	fread_le16(fp); /* current disk number */
-	fread_le16(fp); /* central directory disk number */
-	const uint16_t entries_count = fread_le16(fp);
-	const uint16_t total_entries_count = fread_le16(fp);
+	/* current disk number, central directory disk number */
+	const uint16_t entries_count = READ_LE_UINT16(p + 8);
+	const uint16_t total_entries_count = READ_LE_UINT16(p + 10);
 	assert(total_entries_count == entries_count);
-	fread_le32(fp); /* directory size */
-	fread_le32(fp); /* directory offset */
-	const uint16_t comment_size = fread_le16(fp);
+	const uint32_t directory_size = READ_LE_UINT32(p + 12);
+	const uint32_t directory_offset = READ_LE_UINT32(p + 16);
+	const uint16_t comment_size = READ_LE_UINT16(p + 20);
 	assert(comment_size == 0);
-	struct zipentry_t *entries = (struct zipentry_t *)calloc(entries_count, sizeof(struct zipentry_t));
-	if (!entries) {
+	assert(directory_offset + directory_size <= size - EOD_SIZE);
+	struct zipentry_t *entries = (struct zipentry_t *)Memory_Alloc(MEMORY_ZIPFILES, entries_count * sizeof(struct zipentry_t));
+	/* the names are shorter than the directory records holding them */
+	char *names = (char *)Memory_Alloc(MEMORY_ZIPFILES, directory_size);
+	if (!entries || !names) {
+		Memory_Free(MEMORY_ZIPFILES, entries);
+		Memory_Free(MEMORY_ZIPFILES, names);
+		munmap(data, size);
 		return 0;
 	}
-	fseek(fp, 0, SEEK_SET);
+	memset(entries, 0, entries_count * sizeof(struct zipentry_t));
+	char *next_name = names;
+	int count = 0;
+	p = data + directory_offset;
 	for (int i = 0; i < entries_count; ++i) {
-		struct zipentry_t *entry = &entries[i];
-		const uint32_t signature = fread_le32(fp);
-		assert(signature == 0x04034B50);
-		fread_le16(fp); /* version needed for extraction */
-		fread_le16(fp); /* flags */
-		const uint16_t compression = fread_le16(fp);
-		if (compression != 0) {
+		const uint32_t signature = READ_LE_UINT32(p);
+		assert(signature == 0x02014B50);
+		/* version made by, version needed for extraction, flags */
+		const uint16_t compression = READ_LE_UINT16(p + 10);
+		const uint32_t dostime = READ_LE_UINT32(p + 12);
+		const uint32_t crc = READ_LE_UINT32(p + 16);
+		const uint32_t compressed_size = READ_LE_UINT32(p + 20);
+		const uint32_t uncompressed_size = READ_LE_UINT32(p + 24);
+		const uint16_t name_length = READ_LE_UINT16(p + 28);
+		const uint16_t extra_length = READ_LE_UINT16(p + 30);
+		const uint16_t comment_length = READ_LE_UINT16(p + 32);
+		/* disk number, internal and external attributes */
+		const uint32_t local_offset = READ_LE_UINT32(p + 42);
+		if (compression != COMPRESSION_STORED && compression != COMPRESSION_DEFLATE) {
 			fprintf(stderr, "Unhandled compression %d\n", compression);
-			continue;
-		}
-		fread_le16(fp); /* last modification file time */
-		fread_le16(fp); /* last modification file date */
-		fread_le32(fp); /* crc */
-		entry->size = fread_le32(fp);
-		const uint32_t compressed_size = fread_le32(fp);
-		const uint16_t name_length = fread_le16(fp);
-		const uint16_t extra_length = fread_le16(fp);
-		if (name_length != 0) {
-			entry->name = (char *)malloc(name_length + 1);
-			if (entry->name) {
-				fread(entry->name, 1, name_length, fp);
-				entry->name[name_length] = 0;
-			} else {
-				fseek(fp, name_length, SEEK_CUR);
-			}
+		} else if (name_length != 0) {
+			struct zipentry_t *entry = &entries[count++];
+			entry->name = next_name;
+			memcpy(next_name, p + 46, name_length);
+			next_name[name_length] = 0;
+			next_name += name_length + 1;
+			entry->offset = local_offset;
+			entry->size = uncompressed_size;
+			entry->compressed_size = compressed_size;
+			entry->crc = crc;
+			entry->dostime = dostime;
+			entry->compression = compression;
+			assert(local_offset + compressed_size <= directory_offset);
+			// fprintf(stdout, "file %s compression %d size %d compressed_size %d\n", entry->name, compression, entry->size, compressed_size);
 		}
-		if (extra_length != 0) {
-			fseek(fp, extra_length, SEEK_CUR);
-		}
-		entry->offset = ftell(fp);
-		fseek(fp, compressed_size, SEEK_CUR);
-		// fprintf(stdout, "file %s compression %d size %d compressed_size %d\n", entry->name, compression, entry->size, compressed_size);
+		p += 46 + name_length + extra_length + comment_length;
 	}
-	qsort(entries, entries_count, sizeof(struct zipentry_t), compare_zipentry);
+	qsort(entries, count, sizeof(struct zipentry_t), compare_zipentry);
 
-	struct zipfile_t *zf = (struct zipfile_t *)malloc(sizeof(struct zipfile_t));
+	struct zipfile_t *zf = (struct zipfile_t *)Memory_Alloc(MEMORY_ZIPFILES, sizeof(struct zipfile_t));
 	if (zf) {
-		zf->fp = fp;
+		atomic_init(&zf->refs, 1);
+		zf->data = data;
+		zf->size = size;
+		zf->names = names;
 		zf->entries = entries;
-		zf->entries_count = entries_count;
+		zf->entries_count = count;
+		zf->directory_count = entries_count;
 	}
 	return zf;
 }
 
-void Zipfile_Close(struct zipfile_t *zf) {
-	fclose(zf->fp);
-	for (int i = 0; i < zf->entries_count; ++i) {
-		free(zf->entries[i].name);
+static void release_zipfile(struct zipfile_t *zf) {
+	if (atomic_fetch_sub(&zf->refs, 1) != 1) {
+		return;
 	}
-	free(zf->entries);
+	munmap(zf->data, zf->size);
+	Memory_Free(MEMORY_ZIPFILES, zf->names);
+	zf->names = 0;
+	Memory_Free(MEMORY_ZIPFILES, zf->entries);
 	zf->entries = 0;
 	zf->entries_count = 0;
-	free(zf);
+	Memory_Free(MEMORY_ZIPFILES, zf);
+}
+
+void Zipfile_Close(struct zipfile_t *zf) {
+	release_zipfile(zf);
+}
+
+int Zipfile_GetEntriesCount(struct zipfile_t *zf) {
+	return zf->entries_count;
+}
+
+int Zipfile_GetDirectoryCount(struct zipfile_t *zf) {
+	return zf->directory_count;
+}
+
+struct zipentry_t *Zipfile_GetEntry(struct zipfile_t *zf, int num) {
+	assert(num >= 0 && num < zf->entries_count);
+	return &zf->entries[num];
+}
+
+const char *Zipfile_GetEntryName(struct zipfile_t *zf, struct zipentry_t *ze) {
+	return ze->name;
 }
 
 struct zipentry_t *Zipfile_Find(struct zipfile_t *zf, const char *name) {
 	struct zipentry_t ze;
-	ze.name = name;
+	ze.name = (char *)name;
         return (struct zipentry_t *)bsearch(&ze, zf->entries, zf->entries_count, sizeof(struct zipentry_t), compare_zipentry);
 }
 
+static const uint8_t *get_entry_data(struct zipfile_t *zf, struct zipentry_t *ze) {
+	const uint8_t *p = zf->data + ze->offset;
+	const uint32_t signature = READ_LE_UINT32(p);
+	assert(signature == 0x04034B50);
+	/* the local extra field may differ from the central directory one */
+	const uint16_t name_length = READ_LE_UINT16(p + 26);
+	const uint16_t extra_length = READ_LE_UINT16(p + 28);
+	p += 30 + name_length + extra_length;
+	assert(p + ze->compressed_size <= zf->data + zf->size);
+	return p;
+}
+
+void Zipfile_GetEntryRaw(struct zipfile_t *zf, struct zipentry_t *ze, struct zipentry_raw_t *raw) {
+	raw->offset = ze->offset;
+	raw->size = ze->size;
+	raw->compressed_size = ze->compressed_size;
+	raw->crc = ze->crc;
+	raw->dostime = ze->dostime;
+	raw->compression = ze->compression;
+	raw->data = get_entry_data(zf, ze);
+}
+
+static void advise_range(const uint8_t *p, uint32_t size, int advice) {
+	if (size != 0) {
+		static const int ADVICES[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED };
+		const uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+		const uintptr_t start = (uintptr_t)p & ~page_mask;
+		madvise((void *)start, (uintptr_t)p + size - start, ADVICES[advice]);
+	}
+}
+
+const uint8_t *Zipfile_MapEntry(struct zipfile_t *zf, struct zipentry_t *ze, int advice) {
+	if (ze->compression != COMPRESSION_STORED) {
+		return 0;
+	}
+	const uint8_t *p = get_entry_data(zf, ze);
+	advise_range(p, ze->size, advice);
+	return p;
+}
+
+#define MAX_CHECKPOINTS 16
+#define MIN_CHECKPOINT_INTERVAL (64 * 1024)
+
+struct checkpoint_t {
+	uint32_t offset;
+	z_stream z_str;
+};
+
+struct zipinflate_t {
+	z_stream z_str;
+	uint32_t interval;
+	int checkpoints_count;
+	struct checkpoint_t checkpoints[MAX_CHECKPOINTS];
+};
+
+struct zipreader_t {
+	struct zipfile_t *zf;
+	const uint8_t *data;
+	uint32_t size;
+	uint32_t offset;
+	struct zipinflate_t *inflate; /* deflate entries */
+	uint32_t compressed_size;
+};
+
+/* the inflate states, including the checkpoint copies, are accounted to the archives memory */
+
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+	return Memory_Alloc(MEMORY_ZIPFILES, (size_t)items * size);
+}
+
+static void zlib_free(voidpf opaque, voidpf address) {
+	Memory_Free(MEMORY_ZIPFILES, address);
+}
+
+static int init_inflate(struct zipreader_t *zr) {
+	struct zipinflate_t *zi = zr->inflate;
+	memset(&zi->z_str, 0, sizeof(zi->z_str));
+	zi->z_str.zalloc = zlib_alloc;
+	zi->z_str.zfree = zlib_free;
+	zi->z_str.next_in = (Bytef *)zr->data;
+	zi->z_str.avail_in = zr->compressed_size;
+	zr->offset = 0;
+	return inflateInit2(&zi->z_str, -MAX_WBITS); /* raw deflate data */
+}
+
+/* the inflate state is saved at regular intervals of the uncompressed data to seek backwards */
+static int inflate_data(struct zipreader_t *zr, uint8_t *buf, int count) {
+	struct zipinflate_t *zi = zr->inflate;
+	int total = 0;
+	while (total < count) {
+		uint32_t len = count - total;
+		const uint32_t next_checkpoint = (zi->checkpoints_count + 1) * zi->interval;
+		if (zi->checkpoints_count < MAX_CHECKPOINTS && zr->offset < next_checkpoint && zr->offset + len > next_checkpoint) {
+			len = next_checkpoint - zr->offset;
+		}
+		zi->z_str.next_out = buf + total;
+		zi->z_str.avail_out = len;
+		const int ret = inflate(&zi->z_str, Z_NO_FLUSH);
+		const int produced = len - zi->z_str.avail_out;
+		total += produced;
+		zr->offset += produced;
+		if (zr->offset == next_checkpoint && zi->checkpoints_count < MAX_CHECKPOINTS) {
+			struct checkpoint_t *checkpoint = &zi->checkpoints[zi->checkpoints_count];
+			if (inflateCopy(&checkpoint->z_str, &zi->z_str) == Z_OK) {
+				checkpoint->offset = zr->offset;
+				++zi->checkpoints_count;
+			}
+		}
+		if (ret != Z_OK) {
+			if (ret != Z_STREAM_END) {
+				fprintf(stderr, "inflate ret:%d offset:%d\n", ret, zr->offset);
+			}
+			break;
+		}
+		if (produced == 0) {
+			break;
+		}
+	}
+	return total;
+}
+
+static int seek_inflate(struct zipreader_t *zr, uint32_t offset) {
+	struct zipinflate_t *zi = zr->inflate;
+	/* restart from the closest saved state before the offset */
+	int i = zi->checkpoints_count - 1;
+	for (; i >= 0 && zi->checkpoints[i].offset > offset; --i);
+	const uint32_t restart_offset = (i < 0) ? 0 : zi->checkpoints[i].offset;
+	if (offset < zr->offset || restart_offset > zr->offset) {
+		inflateEnd(&zi->z_str);
+		if (i < 0) {
+			if (init_inflate(zr) != Z_OK) {
+				return -1;
+			}
+		} else {
+			if (inflateCopy(&zi->z_str, &zi->checkpoints[i].z_str) != Z_OK) {
+				return -1;
+			}
+			zr->offset = restart_offset;
+		}
+	}
+	uint8_t buf[4096];
+	while (zr->offset < offset) {
+		const int count = MIN(offset - zr->offset, sizeof(buf));
+		if (inflate_data(zr, buf, count) != count) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
 static ssize_t zipentry_read(void *cookie, char *buf, size_t size) {
-	struct zipentry_t *ze = (struct zipentry_t *)cookie;
-	// fprintf(stdout, "zipentry_read ze %p size %ld\n", (void *)ze, size);
-	const int count = (ze->buffer_offset + size > ze->size) ? (ze->size - ze->buffer_offset) : size;
+	struct zipreader_t *zr = (struct zipreader_t *)cookie;
+	// fprintf(stdout, "zipentry_read zr %p size %ld\n", (void *)zr, size);
+	const int count = (zr->offset + size > zr->size) ? (zr->size - zr->offset) : size;
 	if (count > 0) {
-		memcpy(buf, ze->buffer + ze->buffer_offset, count);
-		ze->buffer_offset += count;
+		if (zr->inflate) {
+			return inflate_data(zr, (uint8_t *)buf, count);
+		}
+		memcpy(buf, zr->data + zr->offset, count);
+		zr->offset += count;
 		return count;
 	}
 	return 0;
 }
 
 static int zipentry_seek(void *cookie, off_t *offset, int whence) {
-	struct zipentry_t *ze = (struct zipentry_t *)cookie;
-	// fprintf(stdout, "zipentry_seek ze %p whence %d offset %ld\n", (void *)ze, whence, *offset);
-	int next_offset = ze->buffer_offset;
+	struct zipreader_t *zr = (struct zipreader_t *)cookie;
+	// fprintf(stdout, "zipentry_seek zr %p whence %d offset %ld\n", (void *)zr, whence, *offset);
+	int next_offset = zr->offset;
 	switch (whence) {
 	case SEEK_SET:
 		next_offset = *offset;
@@ -129,46 +358,74 @@ static int zipentry_seek(void *cookie, off_t *offset, int whence) {
 		next_offset += *offset;
 		break;
 	case SEEK_END:
-		next_offset = ze->size + *offset;
+		next_offset = zr->size + *offset;
 		break;
 	}
-	if (next_offset < 0 || next_offset > ze->size) {
+	if (next_offset < 0 || next_offset > zr->size) {
 		return -1;
 	}
-	ze->buffer_offset = *offset = next_offset;
+	if (zr->inflate) {
+		if (seek_inflate(zr, next_offset) < 0) {
+			return -1;
+		}
+	}
+	zr->offset = *offset = next_offset;
 	return 0;
 }
 
 static int zipentry_close(void *cookie) {
-	struct zipentry_t *ze = (struct zipentry_t *)cookie;
-	free(ze->buffer);
-	ze->buffer = 0;
+	struct zipreader_t *zr = (struct zipreader_t *)cookie;
+	if (zr->inflate) {
+		inflateEnd(&zr->inflate->z_str);
+		for (int i = 0; i < zr->inflate->checkpoints_count; ++i) {
+			inflateEnd(&zr->inflate->checkpoints[i].z_str);
+		}
+		Memory_Free(MEMORY_ZIPFILES, zr->inflate);
+	}
+	release_zipfile(zr->zf);
+	Memory_Free(MEMORY_ZIPFILES, zr);
 	return 0;
 }
 
 FILE *Zipfile_OpenEntry(struct zipfile_t *zf, struct zipentry_t *ze) {
-	uint8_t *buffer = (uint8_t *)malloc(ze->size);
-	if (!buffer) {
-		fprintf(stderr, "Failed to allocate %d bytes\n", ze->size);
+	/* each handle has its own cursor, reads are served from the archive mapping */
+	struct zipreader_t *zr = (struct zipreader_t *)Memory_Alloc(MEMORY_ZIPFILES, sizeof(struct zipreader_t));
+	if (!zr) {
+		fprintf(stderr, "Failed to allocate %d bytes\n", (int)sizeof(struct zipreader_t));
 		return 0;
 	}
-	fseek(zf->fp, ze->offset, SEEK_SET);
-	const int count = fread(buffer, 1, ze->size, zf->fp);
-	// fprintf(stdout, "Read %d bytes from zf %p\n", count, (void *)zf);
-	if (count != ze->size) {
-		fprintf(stderr, "Error reading %d bytes, ret %d\n", ze->size, count);
-		free(buffer);
-		return 0;
+	atomic_fetch_add(&zf->refs, 1);
+	zr->zf = zf;
+	zr->data = get_entry_data(zf, ze);
+	zr->size = ze->size;
+	zr->offset = 0;
+	zr->inflate = 0;
+	zr->compressed_size = ze->compressed_size;
+	advise_range(zr->data, ze->compressed_size, ZIPFILE_ADVICE_SEQUENTIAL);
+	if (ze->compression == COMPRESSION_DEFLATE) {
+		/* the memory used does not depend on the entry size */
+		zr->inflate = (struct zipinflate_t *)Memory_Alloc(MEMORY_ZIPFILES, sizeof(struct zipinflate_t));
+		if (!zr->inflate || init_inflate(zr) != Z_OK) {
+			fprintf(stderr, "Failed to initialize inflate for '%s'\n", ze->name);
+			Memory_Free(MEMORY_ZIPFILES, zr->inflate);
+			release_zipfile(zf);
+			Memory_Free(MEMORY_ZIPFILES, zr);
+			return 0;
+		}
+		zr->inflate->interval = MAX(MIN_CHECKPOINT_INTERVAL, ze->size / MAX_CHECKPOINTS);
+		zr->inflate->checkpoints_count = 0;
 	}
-	ze->buffer = buffer;
-	ze->buffer_offset = 0;
 	cookie_io_functions_t funcs = {
 		.read = zipentry_read,
 		.write = 0,
 		.seek = zipentry_seek,
 		.close = zipentry_close,
 	};
-	return fopencookie(ze, "r", funcs);
+	FILE *fp = fopencookie(zr, "r", funcs);
+	if (!fp) {
+		zipentry_close(zr);
+	}
+	return fp;
 }
 
 int Zipfile_GetEntrySize(struct zipfile_t *zf, struct zipentry_t *ze) {
@@ -7,11 +7,36 @@
 struct zipfile_t;
 struct zipentry_t;
 
+enum {
+	ZIPFILE_ADVICE_NORMAL,
+	ZIPFILE_ADVICE_SEQUENTIAL,
+	ZIPFILE_ADVICE_RANDOM,
+	ZIPFILE_ADVICE_WILLNEED
+};
+
+/* an entry as stored in the archive */
+struct zipentry_raw_t {
+	uint32_t offset; /* local file header */
+	uint32_t size;
+	uint32_t compressed_size;
+	uint32_t crc;
+	uint32_t dostime;
+	uint16_t compression;
+	const uint8_t *data;
+};
+
 struct zipfile_t *Zipfile_Open(const char *name);
 void Zipfile_Close(struct zipfile_t *zf);
 
+int Zipfile_GetEntriesCount(struct zipfile_t *zf);
+int Zipfile_GetDirectoryCount(struct zipfile_t *zf);
+struct zipentry_t *Zipfile_GetEntry(struct zipfile_t *zf, int num);
+const char *Zipfile_GetEntryName(struct zipfile_t *zf, struct zipentry_t *ze);
+
 struct zipentry_t *Zipfile_Find(struct zipfile_t *zf, const char *name);
+const uint8_t *Zipfile_MapEntry(struct zipfile_t *zf, struct zipentry_t *ze, int advice);
 FILE *Zipfile_OpenEntry(struct zipfile_t *zf, struct zipentry_t *ze);
 int Zipfile_GetEntrySize(struct zipfile_t *zf, struct zipentry_t *ze);
+void Zipfile_GetEntryRaw(struct zipfile_t *zf, struct zipentry_t *ze, struct zipentry_raw_t *raw);
 
 #endif